@@ -0,0 +1,463 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "ua_parser.hpp"
+#include "ua_parser_batch.hpp"
+#include "ua_parser_cache.hpp"
+#include "ua_parser_compact.hpp"
+
+static std::atomic<size_t> allocations{0};
+
+// Kept out of line, together with the deletes below, so the compiler does
+// not see malloc() and free() behind them and flag every new/delete pair as
+// mismatched.
+__attribute__((noinline)) void* operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size ? size : 1))
+    {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+namespace
+{
+
+enum Group
+{
+    Browser,
+    Cpu,
+    Device,
+    Engine,
+    Os,
+};
+
+// Rough shape of our edge traffic: a handful of desktop and mobile browsers
+// dominate, bots and scripted clients make up a sizeable tail.
+struct WeightedUa
+{
+    double weight;
+    const char* ua;
+};
+
+const WeightedUa TRAFFIC[] = {
+    {22, "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/91.0.4472.124 Safari/537.36"},
+    {9, "Mozilla/5.0 (iPhone; CPU iPhone OS 14_6 like Mac OS X) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/14.1.1 Mobile/15E148 Safari/604.1"},
+    {9, "Mozilla/5.0 (Linux; Android 11; SM-G991B) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/91.0.4472.120 Mobile Safari/537.36"},
+    {6, "Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/91.0.4472.114 Safari/537.36"},
+    {5, "Mozilla/5.0 (Windows NT 10.0; Win64; x64; rv:89.0) Gecko/20100101 Firefox/89.0"},
+    {5, "Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/14.1.1 Safari/605.1.15"},
+    {4, "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/91.0.4472.124 Safari/537.36 Edg/91.0.864.59"},
+    {3, "Mozilla/5.0 (iPad; CPU OS 14_6 like Mac OS X) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/14.1.1 Mobile/15E148 Safari/604.1"},
+    {3, "Mozilla/5.0 (iPhone; CPU iPhone OS 14_6 like Mac OS X) AppleWebKit/605.1.15 (KHTML, like Gecko) CriOS/91.0.4472.80 Mobile/15E148 Safari/604.1"},
+    {2, "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/91.0.4472.114 Safari/537.36"},
+    {2, "Mozilla/5.0 (Windows NT 6.1; WOW64; Trident/7.0; rv:11.0) like Gecko"},
+    {2, "Mozilla/5.0 (Linux; Android 10; SM-T510) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/91.0.4472.120 Safari/537.36"},
+    {1, "Mozilla/5.0 (Windows NT 6.1; WOW64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/43.0.2357.81 Safari/537.36 OPR/30.0.1835.59"},
+    {1, "Mozilla/5.0 (Linux; U; Android 4.0.3; en-us; KFTT Build/IML74K) AppleWebKit/535.19 (KHTML, like Gecko) Silk/3.4 Mobile Safari/535.19 Silk-Accelerated=true"},
+    {1, "Opera/9.80 (Android; Opera Mini/7.5.33361/31.1448; U; en) Presto/2.8.119 Version/11.1010"},
+    {1, "Mozilla/5.0 (Linux; U; Android 4.0.3; en-us) AppleWebKit/534.30 (KHTML, like Gecko) Version/4.0 UCBrowser/9.8.0.435 U3/0.8.0 Mobile Safari/534.30"},
+    {1, "Mozilla/5.0 (BB10; Touch) AppleWebKit/537.10+ (KHTML, like Gecko) Version/10.0.9.2372 Mobile Safari/537.10+"},
+    {4, "Mozilla/5.0 (compatible; Googlebot/2.1; +http://www.google.com/bot.html)"},
+    {2, "Mozilla/5.0 (compatible; bingbot/2.0; +http://www.bing.com/bingbot.htm)"},
+    {2, "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) HeadlessChrome/91.0.4472.114 Safari/537.36"},
+    {3, "curl/7.68.0"},
+    {2, "python-requests/2.25.1"},
+    {2, "kube-probe/1.21"},
+    {1, "Go-http-client/1.1"},
+    {1, "facebookexternalhit/1.1 (+http://www.facebook.com/externalhit_uatext.php)"},
+};
+
+// 10k UAs drawn from TRAFFIC, or one UA per line of $UAP_BENCH_CORPUS.
+const std::vector<std::string>& corpus()
+{
+    static const auto uas = [] {
+        auto result = std::vector<std::string>();
+        if (const auto path = std::getenv("UAP_BENCH_CORPUS"))
+        {
+            std::ifstream in{path};
+            std::string line;
+            while (std::getline(in, line))
+            {
+                result.push_back(line);
+            }
+            return result;
+        }
+        auto weights = std::vector<double>();
+        for (const auto& entry : TRAFFIC)
+        {
+            weights.push_back(entry.weight);
+        }
+        auto rng = std::mt19937{42};
+        auto pick = std::discrete_distribution<size_t>(weights.begin(), weights.end());
+        for (size_t idx = 0; idx < 10000; ++idx)
+        {
+            result.push_back(TRAFFIC[pick(rng)].ua);
+        }
+        return result;
+    }();
+    return uas;
+}
+
+const std::vector<uap::StringView>& corpusViews()
+{
+    static const auto views = std::vector<uap::StringView>(corpus().begin(), corpus().end());
+    return views;
+}
+
+void reportPerItem(benchmark::State& state, const size_t allocationsBefore)
+{
+    state.SetItemsProcessed(state.iterations());
+    state.counters["allocs/parse"] = benchmark::Counter(
+        static_cast<double>(allocations.load() - allocationsBefore),
+        benchmark::Counter::kAvgIterations);
+}
+
+void BM_Parse(benchmark::State& state)
+{
+    const auto parser = uap::UaParser{};
+    const auto ua = std::string{TRAFFIC[state.range(0)].ua};
+    const auto before = allocations.load();
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(parser.parse(ua));
+    }
+    reportPerItem(state, before);
+}
+BENCHMARK(BM_Parse)->DenseRange(0, sizeof(TRAFFIC) / sizeof(TRAFFIC[0]) - 1);
+
+void BM_ParseView(benchmark::State& state)
+{
+    const auto parser = uap::UaParser{};
+    const auto ua = std::string{TRAFFIC[state.range(0)].ua};
+    const auto before = allocations.load();
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(parser.parseView(ua));
+    }
+    reportPerItem(state, before);
+}
+BENCHMARK(BM_ParseView)->Arg(0)->Arg(1)->Arg(17)->Arg(20);
+
+// One group's rules, by parsing only its fields: the other groups' rules
+// are skipped, leaving the prefilter scan as the only shared cost.
+void BM_ParseGroup(benchmark::State& state)
+{
+    static const uap::FieldMask groupFields[] = {
+        uap::Fields::Browser, uap::Fields::Cpu, uap::Fields::Device, uap::Fields::Engine, uap::Fields::Os};
+    auto parser = uap::UaParser{};
+    parser.setBotHandling(uap::UaParser::BotHandling::Ignore);
+    const auto& uas = corpusViews();
+    const auto fields = groupFields[state.range(0)];
+    auto context = uap::UaParser::ParseContext();
+    size_t idx = 0;
+    const auto before = allocations.load();
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(parser.parseView(uas[idx++ % uas.size()], context, fields));
+    }
+    reportPerItem(state, before);
+}
+BENCHMARK(BM_ParseGroup)->Arg(Browser)->Arg(Cpu)->Arg(Device)->Arg(Engine)->Arg(Os);
+
+// Each formatter behind the rule that applies it, parsing only the field it
+// writes.
+void BM_Formatter(benchmark::State& state)
+{
+    static const std::pair<const char*, uap::FieldMask> formatted[] = {
+        {"Mozilla/4.0 (compatible; MSIE 8.0; Windows NT 6.1)", uap::Fields::OsVersion}, // FnFixWindowsVersion
+        {"Mozilla/5.0 (Macintosh; U; PPC Mac OS X; en) AppleWebKit/412 (KHTML, like Gecko) Safari/412",
+         uap::Fields::BrowserVersion},                                                             // FnFixSafariVersion
+        {"Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7)", uap::Fields::OsVersion},               // FnReplace
+        {"Mozilla/5.0 (Macintosh; U; PowerPC Mac OS X; en)", uap::Fields::CpuArchitecture},        // FnToLower
+    };
+    auto parser = uap::UaParser{};
+    parser.setBotHandling(uap::UaParser::BotHandling::Ignore);
+    const auto& ua = formatted[state.range(0)];
+    auto context = uap::UaParser::ParseContext();
+    const auto before = allocations.load();
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(parser.parseView(ua.first, context, ua.second));
+    }
+    reportPerItem(state, before);
+}
+BENCHMARK(BM_Formatter)->DenseRange(0, 3);
+
+void BM_ParseCorpus(benchmark::State& state)
+{
+    const auto parser = uap::UaParser{};
+    const auto& uas = corpusViews();
+    size_t idx = 0;
+    const auto before = allocations.load();
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(parser.parseView(uas[idx++ % uas.size()]).toResult());
+    }
+    reportPerItem(state, before);
+}
+BENCHMARK(BM_ParseCorpus);
+
+// The corpus with range(0) as the bot handling: ignore, detect, or
+// short-circuit.
+void BM_ParseCorpusBots(benchmark::State& state)
+{
+    auto parser = uap::UaParser{};
+    parser.setBotHandling(static_cast<uap::UaParser::BotHandling>(state.range(0)));
+    const auto& uas = corpusViews();
+    size_t idx = 0;
+    const auto before = allocations.load();
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(parser.parseView(uas[idx++ % uas.size()]).toResult());
+    }
+    reportPerItem(state, before);
+}
+BENCHMARK(BM_ParseCorpusBots)->DenseRange(0, 2);
+
+// Same corpus through a reused context and result, after a first pass that
+// lets their buffers grow; allocs/parse should stay at zero.
+void BM_ParseCorpusContext(benchmark::State& state)
+{
+    const auto parser = uap::UaParser{};
+    const auto& uas = corpusViews();
+    auto context = uap::UaParser::ParseContext();
+    auto result = uap::UaParser::Result();
+    for (const auto& ua : uas)
+    {
+        parser.parse(ua, context, result);
+    }
+    size_t idx = 0;
+    const auto before = allocations.load();
+    for (auto _ : state)
+    {
+        parser.parse(uas[idx++ % uas.size()], context, result);
+        benchmark::DoNotOptimize(result);
+    }
+    reportPerItem(state, before);
+}
+BENCHMARK(BM_ParseCorpusContext);
+
+void BM_CompactCorpus(benchmark::State& state)
+{
+    const auto parser = uap::UaParser{};
+    uap::InternTable table;
+    const auto& uas = corpusViews();
+    size_t idx = 0;
+    const auto before = allocations.load();
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(uap::parseCompact(parser, table, uas[idx++ % uas.size()]));
+    }
+    reportPerItem(state, before);
+    state.counters["interned"] = static_cast<double>(table.size());
+}
+BENCHMARK(BM_CompactCorpus);
+
+// Startup cost up to the first result, with range(0) != 0 compiling every
+// expression first.
+void BM_ColdStart(benchmark::State& state)
+{
+    const auto identity = [] {
+        auto order = std::vector<std::vector<size_t>>();
+        for (const auto count : uap::UaParser{}.ruleCounts())
+        {
+            order.emplace_back(count);
+            std::iota(order.back().begin(), order.back().end(), size_t{0});
+        }
+        return order;
+    }();
+    for (auto _ : state)
+    {
+        // Rebuilding the rules in their own order leaves them uncompiled.
+        auto parser = uap::UaParser{};
+        parser.reorderRules(identity);
+        if (state.range(0) != 0)
+        {
+            parser.warmup();
+        }
+        benchmark::DoNotOptimize(parser.parse(TRAFFIC[0].ua));
+    }
+}
+BENCHMARK(BM_ColdStart)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+// Field sets of our analytics rollups and of the ad-serving path.
+void BM_ParseFields(benchmark::State& state)
+{
+    const auto parser = uap::UaParser{};
+    const auto& uas = corpusViews();
+    const auto fields = static_cast<uap::FieldMask>(state.range(0));
+    size_t idx = 0;
+    const auto before = allocations.load();
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(parser.parseView(uas[idx++ % uas.size()], fields).toResult());
+    }
+    reportPerItem(state, before);
+}
+BENCHMARK(BM_ParseFields)
+    ->Arg(uap::Fields::BrowserName | uap::Fields::BrowserVersion)
+    ->Arg(uap::Fields::DeviceType)
+    ->Arg(uap::Fields::Device | uap::Fields::Os);
+
+void BM_CachedCorpus(benchmark::State& state)
+{
+    const auto parser = uap::CachingUaParser{4096};
+    const auto& uas = corpusViews();
+    size_t idx = 0;
+    const auto before = allocations.load();
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(parser.parse(uas[idx++ % uas.size()]));
+    }
+    reportPerItem(state, before);
+}
+BENCHMARK(BM_CachedCorpus);
+
+void BM_ParseBatch(benchmark::State& state)
+{
+    const auto parser = uap::UaParser{};
+    const auto& uas = corpusViews();
+    uap::ThreadPool pool{static_cast<size_t>(state.range(0))};
+    auto results = std::vector<uap::UaParser::Result>(uas.size());
+    const auto before = allocations.load();
+    for (auto _ : state)
+    {
+        uap::parseBatch(parser, pool, uas.data(), uas.size(), results.data());
+    }
+    state.SetItemsProcessed(state.iterations() * uas.size());
+    state.counters["allocs/parse"] = benchmark::Counter(
+        static_cast<double>(allocations.load() - before) / uas.size(),
+        benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_ParseBatch)->Arg(1)->Arg(2)->Arg(4)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+// Same batch, every distinct UA parsed once and copied to its duplicates.
+void BM_ParseBatchDistinct(benchmark::State& state)
+{
+    const auto parser = uap::UaParser{};
+    const auto& uas = corpusViews();
+    uap::ThreadPool pool{static_cast<size_t>(state.range(0))};
+    auto results = std::vector<uap::UaParser::Result>(uas.size());
+    for (auto _ : state)
+    {
+        uap::parseBatchDistinct(parser, pool, uas.data(), uas.size(), results.data());
+    }
+    state.SetItemsProcessed(state.iterations() * uas.size());
+}
+BENCHMARK(BM_ParseBatchDistinct)->Arg(1)->Arg(2)->Arg(4)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+// UAs carrying the literals that get exponential patterns past the
+// prefilter, followed by a long run of word characters they backtrack on;
+// HOSTILE_VARIANTS random runs per literal.
+const size_t HOSTILE_VARIANTS = 16;
+
+std::vector<std::string> hostileUas(const size_t length)
+{
+    static const char* const seeds[] = {
+        "Mozilla/5.0 (iPhone; like; CPU iPhone OS ",
+        "Mozilla/5.0 (iPad; like mac os ",
+        "Mozilla/5.0 (Linux; Android 4.4; Nokia ",
+        "sprint lunascape/",
+    };
+    auto rng = std::mt19937{7};
+    auto result = std::vector<std::string>();
+    for (const auto seed : seeds)
+    {
+        for (size_t variant = 0; variant < HOSTILE_VARIANTS; ++variant)
+        {
+            auto ua = std::string{seed};
+            while (ua.size() < length)
+            {
+                ua += "a_1B"[rng() % 4];
+            }
+            result.push_back(ua);
+        }
+    }
+    return result;
+}
+
+// Latency percentiles over hostile UAs of range(0) bytes, with no limits
+// or, for range(1) != 0, with 256 bytes and a 1ms budget, which a search
+// already running can overrun. One parse per iteration, cycling through
+// the UAs; p999 is only reported from a thousand samples on, below which
+// it would just be the maximum.
+void BM_Adversarial(benchmark::State& state)
+{
+    const auto limits = state.range(1) != 0
+                            ? uap::UaParser::Limits{256, std::chrono::microseconds{1000}}
+                            : uap::UaParser::Limits{0, std::chrono::microseconds{0}};
+    const auto parser = uap::UaParser{limits};
+    const auto uas = hostileUas(static_cast<size_t>(state.range(0)));
+    parser.warmup(); // keeps compilation out of the timings
+    auto latencies = std::vector<double>();
+    size_t idx = 0;
+    for (auto _ : state)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        benchmark::DoNotOptimize(parser.parseView(uas[idx++ % uas.size()]));
+        latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+    }
+    std::sort(latencies.begin(), latencies.end());
+    const auto percentile = [&latencies](const double p) {
+        return latencies[std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))];
+    };
+    state.counters["samples"] = static_cast<double>(latencies.size());
+    state.counters["p50_us"] = percentile(0.5);
+    if (latencies.size() >= 1000)
+    {
+        state.counters["p999_us"] = percentile(0.999);
+    }
+    state.counters["max_us"] = latencies.back();
+    state.counters["budget_hits"] = static_cast<double>(parser.limitStats().budgetExceeded);
+}
+// Every UA 32 times over, so p999 sits among the two slowest of 2048.
+BENCHMARK(BM_Adversarial)
+    ->Args({256, 0})
+    ->Args({4096, 1})
+    ->Args({65536, 1})
+    ->Iterations(32 * 4 * HOSTILE_VARIANTS)
+    ->Unit(benchmark::kMicrosecond);
+// Unbounded long UAs take around 100ms each: every UA twice, no p999.
+BENCHMARK(BM_Adversarial)->Args({4096, 0})->Iterations(2 * 4 * HOSTILE_VARIANTS)->Unit(benchmark::kMicrosecond);
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+#ifdef UAP_REGEX_RE2
+    benchmark::AddCustomContext("regex_backend", "re2");
+#else
+    benchmark::AddCustomContext("regex_backend", "boost");
+#endif
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
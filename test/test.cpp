@@ -1,5 +1,9 @@
+#include <algorithm>
+#include <atomic>
 #include <fstream>
+#include <functional>
 #include <sstream>
+#include <thread>
 
 #include <gtest/gtest.h>
 
@@ -7,6 +11,10 @@
 #include <json/value.h>
 
 #include "ua_parser.hpp"
+#include "ua_parser_batch.hpp"
+#include "ua_parser_cache.hpp"
+#include "ua_parser_cache_file.hpp"
+#include "ua_parser_compact.hpp"
 
 static Json::Value load_json_from_file(const std::string& path)
 {
@@ -48,6 +56,578 @@ TEST(UaParser, shouldParseFixtures)
     }
 }
 
+TEST(UaParser, shouldBorrowViewsFromInput)
+{
+    const auto parser = uap::UaParser{};
+    const auto ua = std::string{"Mozilla/5.0 (iPhone; CPU iPhone OS 8_3 like Mac OS X) AppleWebKit/600.1.4 (KHTML, like Gecko) Version/8.0 Mobile/12F70 Safari/600.1.4"};
+    const auto view = parser.parseView(ua);
+    const auto inInput = [&ua](uap::StringView v) {
+        return v.data() >= ua.data() && v.data() + v.size() <= ua.data() + ua.size();
+    };
+    EXPECT_EQ("Mobile Safari", view.browserName);
+    EXPECT_FALSE(inInput(view.browserName));
+    EXPECT_EQ("8.0", view.browserVersion);
+    EXPECT_TRUE(inInput(view.browserVersion));
+    EXPECT_EQ("iPhone", view.deviceModel);
+    EXPECT_TRUE(inInput(view.deviceModel));
+    EXPECT_EQ("8.3", view.osVersion);
+    EXPECT_FALSE(inInput(view.osVersion));
+}
+
+TEST(UaParser, shouldParseIntoReusedContextAndResult)
+{
+    const auto parser = uap::UaParser{};
+    const auto fixtures = load_json_from_file("test/fixtures.json");
+    auto context = uap::UaParser::ParseContext();
+    auto result = uap::UaParser::Result();
+    for (const auto& fixture : fixtures)
+    {
+        const auto ua = fixture["userAgent"].asString();
+        const auto expected = parser.parse(ua);
+        parser.parse(ua, context, result);
+        EXPECT_EQ(expected.browserName, result.browserName);
+        EXPECT_EQ(expected.browserVersion, result.browserVersion);
+        EXPECT_EQ(expected.cpuArchitecture, result.cpuArchitecture);
+        EXPECT_EQ(expected.deviceType, result.deviceType);
+        EXPECT_EQ(expected.deviceModel, result.deviceModel);
+        EXPECT_EQ(expected.deviceVendor, result.deviceVendor);
+        EXPECT_EQ(expected.engineName, result.engineName);
+        EXPECT_EQ(expected.osName, result.osName);
+        EXPECT_EQ(expected.osVersion, result.osVersion);
+        EXPECT_EQ(0, expected.osVersionNumber.compare(result.osVersionNumber));
+    }
+
+    const auto ios = std::string{"Mozilla/5.0 (iPhone; CPU iPhone OS 8_3 like Mac OS X) AppleWebKit/600.1.4 (KHTML, like Gecko) Version/8.0 Mobile/12F70 Safari/600.1.4"};
+    EXPECT_EQ("8.3", parser.parseView(ios, context).osVersion);
+}
+
+TEST(UaParser, shouldMatchIgnoringCaseButKeepCapturedCase)
+{
+    const auto parser = uap::UaParser{};
+    const auto ua = std::string{"MOZILLA/5.0 (X11; LINUX X86_64) APPLEWEBKIT/537.36 (KHTML, LIKE GECKO) CHROME/41.0.2228.0 SAFARI/537.36"};
+    const auto view = parser.parseView(ua);
+    EXPECT_EQ("CHROME", view.browserName);
+    EXPECT_EQ(ua.data() + ua.find("CHROME"), view.browserName.data());
+    EXPECT_EQ("41.0.2228.0", view.browserVersion);
+    EXPECT_EQ("WEBKIT", view.engineName);
+    EXPECT_EQ("LINUX", view.osName);
+    EXPECT_EQ("amd64", view.cpuArchitecture);
+
+    // Ignoring case, [A-z] takes in letters only, not the [\]^_` between.
+    const auto kindle = std::string{"Mozilla/5.0 (Linux; U; Android 4.0.3; en-us; KFTT Build/IML74K) AppleWebKit/535.19 (KHTML, like Gecko) Silk/3.4 Mobile Safari/535.19"};
+    EXPECT_EQ("Amazon", parser.parse(kindle).deviceVendor);
+    auto underscore = kindle;
+    underscore.replace(underscore.find("KFTT"), 4, "KF_T");
+    EXPECT_EQ("", parser.parse(underscore).deviceVendor);
+}
+
+TEST(UaParser, shouldPrefilterOnLiteralsIgnoringCase)
+{
+    const auto parser = uap::UaParser{};
+    // No rule's literals occur in it, so no rule may match, as in a full scan.
+    const auto none = std::string{"Foo/1.0 (Bar; Baz 2.0) Qux/3"};
+    for (size_t group = 0; group < parser.ruleCounts().size(); ++group)
+    {
+        const auto matching = parser.matchingRules(none, group);
+        EXPECT_EQ(0, std::count(matching.begin(), matching.end(), true));
+    }
+    const auto empty = parser.parse(none);
+    EXPECT_EQ("", empty.browserName);
+    EXPECT_EQ("", empty.engineName);
+    EXPECT_EQ("", empty.osName);
+
+    // The literals are lowercase; the input only has to match ignoring case.
+    const auto lower = parser.parse("mozilla/5.0 (windows nt 6.1; rv:31.0) gecko/20100101 firefox/31.0");
+    EXPECT_EQ("firefox", lower.browserName);
+    EXPECT_EQ("31.0", lower.browserVersion);
+    EXPECT_EQ("gecko", lower.engineName);
+    EXPECT_EQ("windows", lower.osName);
+    const auto upper = parser.parse("MOZILLA/5.0 (WINDOWS NT 6.1; RV:31.0) GECKO/20100101 FIREFOX/31.0");
+    EXPECT_EQ("FIREFOX", upper.browserName);
+    EXPECT_EQ("WINDOWS", upper.osName);
+    EXPECT_EQ("7", upper.osVersion);
+}
+
+TEST(UaParser, shouldMatchBrandAlternationsLikeRegex)
+{
+    const auto parser = uap::UaParser{};
+    const auto qq = parser.parse("QQBrowser 7.0");
+    EXPECT_EQ("QQBrowser", qq.browserName);
+    EXPECT_EQ("7.0", qq.browserVersion);
+    const auto tizen = parser.parse("Mozilla/5.0 (Linux) Tizen Browser/v2.1");
+    EXPECT_EQ("Tizen Browser", tizen.browserName);
+    EXPECT_EQ("2.1", tizen.browserVersion);
+    const auto luna = parser.parse("Foo lunascape/6.9.1 bar");
+    EXPECT_EQ("lunascape", luna.browserName);
+    EXPECT_EQ("6.9.1", luna.browserVersion);
+    const auto bare = parser.parse("Foo Lunascape");
+    EXPECT_EQ("Lunascape", bare.browserName);
+    EXPECT_EQ("", bare.browserVersion);
+    // Anchored on the slash, which lands in the next 64-byte word.
+    const auto opera = parser.parse(std::string(61, 'x') + "\tOPR/28.0 (X11)");
+    EXPECT_EQ("Opera", opera.browserName);
+    EXPECT_EQ("28.0", opera.browserVersion);
+}
+
+TEST(UaParser, shouldParseOnlyRequestedFields)
+{
+    const auto parser = uap::UaParser{};
+    const auto ua = std::string{"Mozilla/5.0 (Linux; Android 4.4.2; Nexus 5 Build/KOT49H) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/32.0.1700.99 Mobile Safari/537.36"};
+    const auto full = parser.parse(ua);
+    const auto browser = parser.parse(ua, uap::Fields::BrowserName | uap::Fields::BrowserVersion);
+    EXPECT_EQ(full.browserName, browser.browserName);
+    EXPECT_EQ(full.browserVersion, browser.browserVersion);
+    EXPECT_EQ("", browser.deviceModel);
+    EXPECT_EQ("", browser.osName);
+    const auto device = parser.parse(ua, uap::Fields::DeviceType);
+    EXPECT_EQ(full.deviceType, device.deviceType);
+    EXPECT_EQ("", device.deviceModel);
+
+    // The cpu rules overwrite browserVersion for QuickTime.
+    const auto quicktime = parser.parse("QuickTime/7.6.2 (qtver=7.6.2;cpu=IA32;os=Mac 10.5.8)",
+                                        uap::Fields::BrowserVersion);
+    EXPECT_EQ("ia32", quicktime.browserVersion);
+}
+
+TEST(UaParser, shouldDetectBots)
+{
+    auto parser = uap::UaParser{};
+    const auto ua = std::string{"Mozilla/5.0 (Linux; Android 6.0.1; Nexus 5X Build/MMB29P) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/41.0.2272.96 Mobile Safari/537.36 (compatible; Googlebot/2.1; +http://www.google.com/bot.html)"};
+    const auto detected = parser.parse(ua);
+    EXPECT_TRUE(detected.isBot);
+    EXPECT_EQ("Googlebot", detected.botName);
+    EXPECT_EQ("Android", detected.osName);
+    EXPECT_EQ("mobile", detected.deviceType);
+    EXPECT_FALSE(parser.parse("Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/91.0.4472.124 Safari/537.36").isBot);
+    EXPECT_EQ("curl", parser.parse("curl/7.68.0").botName);
+    const auto generic = parser.parse("ExampleCrawler/1.0");
+    EXPECT_TRUE(generic.isBot);
+    EXPECT_EQ("", generic.botName);
+
+    parser.setBotHandling(uap::UaParser::BotHandling::ShortCircuit);
+    const auto shortCircuited = parser.parse(ua);
+    EXPECT_TRUE(shortCircuited.isBot);
+    EXPECT_EQ("Googlebot", shortCircuited.botName);
+    EXPECT_EQ("", shortCircuited.osName);
+    EXPECT_EQ("", shortCircuited.browserName);
+
+    parser.setBotHandling(uap::UaParser::BotHandling::Ignore);
+    const auto ignored = parser.parse(ua);
+    EXPECT_FALSE(ignored.isBot);
+    EXPECT_EQ("", ignored.botName);
+    EXPECT_EQ("Android", ignored.osName);
+}
+
+TEST(UaParser, shouldParseVersionNumbers)
+{
+    const auto parser = uap::UaParser{};
+    const auto chrome = parser.parse("Mozilla/5.0 (Windows NT 6.1; WOW64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/41.0.2228.0 Safari/537.36");
+    EXPECT_EQ((uap::Version{41, 0, 2228, 0}), chrome.browserVersionNumber);
+    EXPECT_EQ((uap::Version{537, 36}), chrome.engineVersionNumber);
+    EXPECT_TRUE(chrome.browserVersionNumber >= uap::Version{41});
+    EXPECT_TRUE(chrome.browserVersionNumber < uap::Version{90});
+    const auto iphone = parser.parseView("Mozilla/5.0 (iPhone; CPU iPhone OS 8_3 like Mac OS X) AppleWebKit/600.1.4 (KHTML, like Gecko) Version/8.0 Mobile/12F70 Safari/600.1.4");
+    EXPECT_EQ((uap::Version{8, 3}), iphone.osVersionNumber);
+    EXPECT_EQ(uap::Version::parse("8_3"), uap::Version::parse("8.3"));
+    EXPECT_EQ((uap::Version{10, 0, 0, 0}), uap::Version::parse("10.0.0.0.7"));
+    EXPECT_EQ((uap::Version{3, 2}), uap::Version::parse("3.2b1"));
+    EXPECT_EQ(uap::Version{}, uap::Version::parse(""));
+    EXPECT_LT(uap::Version::parse("9.9.9"), uap::Version::parse("10"));
+}
+
+TEST(UaParser, shouldCountRuleAttemptsAndHits)
+{
+    const auto parser = uap::UaParser{};
+    parser.parse("Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:31.0) Gecko/20100101 Firefox/31.0");
+    const auto stats = parser.ruleStats();
+#ifdef UAP_RULE_STATS
+    ASSERT_EQ(parser.compileStats().expressions, stats.size());
+    const auto firefox = std::find_if(stats.begin(), stats.end(), [](const uap::UaParser::ExpressionStats& expression) {
+        return expression.group == 0 && expression.pattern.find("firefox") != std::string::npos && expression.hits != 0;
+    });
+    ASSERT_NE(stats.end(), firefox);
+    EXPECT_GE(firefox->attempts, firefox->hits);
+    EXPECT_EQ(0u, parser.ruleStatsReport().find("group\trule\tattempts"));
+
+    // Counts of threads that have exited are kept.
+    std::thread([&parser] {
+        parser.parse("Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:31.0) Gecko/20100101 Firefox/31.0");
+    }).join();
+    EXPECT_EQ(firefox->hits + 1, parser.ruleStats()[firefox - stats.begin()].hits);
+#else
+    EXPECT_TRUE(stats.empty());
+#endif
+}
+
+TEST(UaParser, shouldStopAtLimits)
+{
+    const auto parser = uap::UaParser{uap::UaParser::Limits{64, std::chrono::microseconds{0}}};
+    const auto ua = std::string{"Mozilla/5.0 (Windows NT 6.1; WOW64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/41.0.2228.0 Safari/537.36"};
+    const auto truncated = parser.parse(ua);
+    EXPECT_TRUE(truncated.truncated);
+    EXPECT_FALSE(truncated.budgetExceeded);
+    EXPECT_EQ("Windows", truncated.osName);
+    EXPECT_EQ("WebKit", truncated.browserName);
+
+    EXPECT_EQ(1u, parser.limitStats().truncated);
+
+    // No limits unless asked for.
+    EXPECT_FALSE(uap::UaParser{}.parse(ua + std::string(2048, ' ')).truncated);
+
+#ifndef UAP_REGEX_RE2
+    // Boost gives up on this one in the os rules; the groups before them
+    // still come back.
+    const auto unlimited = uap::UaParser{};
+    const auto hostile = unlimited.parse("AppleCoreMedia/1.0.0.12B466 palm_8_3(iPhone; UTizenoka(4.90; CPU OS 8_1_3456, APA like Mac OS XwiDs3PoRtABlevu-x; en_us)");
+    EXPECT_TRUE(hostile.budgetExceeded);
+    EXPECT_EQ("iPhone", hostile.deviceModel);
+    EXPECT_EQ("", hostile.osName);
+    EXPECT_EQ(1u, unlimited.limitStats().budgetExceeded);
+#endif
+}
+
+TEST(UaParser, shouldCompileExpressionsOnFirstUse)
+{
+    const auto parser = uap::UaParser{};
+    const auto ua = std::string{"Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:31.0) Gecko/20100101 Firefox/31.0"};
+    const auto lazy = parser.parse(ua);
+    const auto before = parser.compileStats();
+    EXPECT_GT(before.compiled, 0u);
+    EXPECT_LE(before.compiled, before.expressions);
+
+    parser.warmup();
+    const auto after = parser.compileStats();
+    EXPECT_EQ(after.expressions, after.compiled);
+    EXPECT_GE(after.compileTime, before.compileTime);
+    EXPECT_EQ(lazy.browserName, parser.parse(ua).browserName);
+    EXPECT_EQ(lazy.osName, parser.parse(ua).osName);
+}
+
+TEST(UaParser, shouldReloadRulesFromFile)
+{
+    auto parser = uap::UaParser{};
+    const auto path = ::testing::TempDir() + "ua_parser_rules.bin";
+    parser.saveRules(path);
+    const auto version = parser.rulesVersion();
+    const auto copy = parser;
+
+    const auto fixtures = load_json_from_file("test/fixtures.json");
+    std::atomic<bool> done{false};
+    auto reloader = std::thread([&] {
+        for (int idx = 0; idx < 3; ++idx)
+        {
+            parser.loadRules(path);
+        }
+        done = true;
+    });
+    const auto builtin = uap::UaParser{};
+    do
+    {
+        for (const auto& fixture : fixtures)
+        {
+            const auto ua = fixture["userAgent"].asString();
+            const auto expected = builtin.parse(ua);
+            const auto result = copy.parse(ua);
+            EXPECT_EQ(expected.browserName, result.browserName);
+            EXPECT_EQ(expected.osVersion, result.osVersion);
+            EXPECT_EQ(expected.deviceVendor, result.deviceVendor);
+        }
+    } while (!done);
+    reloader.join();
+    EXPECT_EQ(version, copy.rulesVersion());
+
+    auto bytes = std::string();
+    {
+        std::ifstream in{path, std::ios::binary};
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    const auto rewrite = [&path](const std::string& content) {
+        std::ofstream out{path, std::ios::binary};
+        out << content;
+    };
+    auto corrupt = bytes;
+    corrupt[corrupt.size() / 2] ^= 1;
+    rewrite(corrupt);
+    EXPECT_THROW(parser.loadRules(path), std::runtime_error);
+
+    // Outside the checksum: the group count in the 40-byte header.
+    auto fewerGroups = bytes;
+    fewerGroups[8] = 4;
+    rewrite(fewerGroups);
+    EXPECT_THROW(parser.loadRules(path), std::runtime_error);
+
+    // The last group ending a rule early, with the checksum (FNV-1a of
+    // everything after the header) fixed up to match.
+    auto unusedRule = bytes;
+    --unusedRule[40 + 4 * 8 + 4];
+    const auto checksum = uap::fnv1a(uap::StringView(unusedRule).substr(40));
+    unusedRule.replace(32, sizeof(checksum), reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+    rewrite(unusedRule);
+    EXPECT_THROW(parser.loadRules(path), std::runtime_error);
+
+    EXPECT_THROW(parser.loadRules(path + ".missing"), std::runtime_error);
+    EXPECT_EQ(version, parser.rulesVersion());
+    EXPECT_EQ("Chrome", copy.parse("Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/41.0.2228.0 Safari/537.36").browserName);
+}
+
+TEST(UaParser, shouldReorderRulesWithoutChangingResults)
+{
+    const auto builtin = uap::UaParser{};
+    const auto fixtures = load_json_from_file("test/fixtures.json");
+
+    // Rules no fixture matches can go first without changing their results.
+    auto order = std::vector<std::vector<size_t>>();
+    const auto counts = builtin.ruleCounts();
+    for (size_t groupIdx = 0; groupIdx < counts.size(); ++groupIdx)
+    {
+        auto matched = std::vector<bool>(counts[groupIdx], false);
+        for (const auto& fixture : fixtures)
+        {
+            const auto matching = builtin.matchingRules(fixture["userAgent"].asString(), groupIdx);
+            ASSERT_EQ(counts[groupIdx], matching.size());
+            std::transform(matched.begin(), matched.end(), matching.begin(), matched.begin(), std::logical_or<bool>());
+        }
+        order.emplace_back();
+        for (const auto first : {false, true})
+        {
+            for (size_t rule = 0; rule < counts[groupIdx]; ++rule)
+            {
+                if (matched[rule] == first)
+                {
+                    order.back().push_back(rule);
+                }
+            }
+        }
+    }
+
+    auto parser = uap::UaParser{};
+    parser.reorderRules(order);
+    EXPECT_NE(builtin.rulesVersion(), parser.rulesVersion());
+    for (const auto& fixture : fixtures)
+    {
+        const auto ua = fixture["userAgent"].asString();
+        EXPECT_TRUE(builtin.parse(ua) == parser.parse(ua)) << ua;
+    }
+
+    auto duplicate = order;
+    duplicate.front().back() = duplicate.front().front();
+    EXPECT_THROW(parser.reorderRules(duplicate), std::invalid_argument);
+    EXPECT_THROW(parser.reorderRules({}), std::invalid_argument);
+}
+
+TEST(UaParser, shouldParseLikeAFullParseWithImplications)
+{
+    const auto builtin = uap::UaParser{};
+    auto parser = builtin;
+    parser.enableImplications();
+    auto uas = std::vector<std::string>{
+        // An Android x86 tablet, and Chrome for iOS left to the Mac OS rule.
+        "Mozilla/5.0 (Linux; Android 4.4; x86; Nexus 7 Build/KOT49H) AppleWebKit/537.36",
+        "Mozilla/5.0 (iPhone; CPU iPhone OS 14-6 like Mac OS X) AppleWebKit/605.1.15 (KHTML, like Gecko) CriOS/91.0.4472.80 Mobile/15E148 Safari/604.1",
+    };
+    for (const auto& fixture : load_json_from_file("test/fixtures.json"))
+    {
+        uas.push_back(fixture["userAgent"].asString());
+    }
+    for (const auto& ua : uas)
+    {
+        EXPECT_TRUE(builtin.parse(ua) == parser.parse(ua)) << ua;
+    }
+    EXPECT_TRUE(builtin.parse(uas[0]) != builtin.parse(uas[1]));
+    EXPECT_EQ("Nexus 7", parser.parse(uas[0]).deviceModel);
+    EXPECT_EQ("Mac OS", parser.parse(uas[1]).osName);
+}
+
+TEST(InternTable, shouldCompactResultsIntoStableIds)
+{
+    const auto parser = uap::UaParser{};
+    uap::InternTable table;
+    const auto chrome = std::string{"Mozilla/5.0 (Windows NT 6.1; WOW64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/41.0.2228.0 Safari/537.36"};
+    const auto firefox = std::string{"Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:31.0) Gecko/20100101 Firefox/31.0"};
+
+    const auto compact = uap::parseCompact(parser, table, chrome);
+    EXPECT_EQ(compact, uap::parseCompact(parser, table, chrome));
+    EXPECT_NE(compact, uap::parseCompact(parser, table, firefox));
+    EXPECT_EQ(uap::CompactResultHash{}(compact), uap::CompactResultHash{}(uap::parseCompact(parser, table, chrome)));
+    EXPECT_EQ("Chrome", table.lookup(compact.browserName));
+    EXPECT_EQ("Windows", table.lookup(compact.osName));
+    EXPECT_EQ(uap::InternTable::EMPTY, compact.deviceModel);
+    EXPECT_EQ("", table.lookup(compact.deviceModel));
+    EXPECT_EQ(uap::packVersion(uap::Version{41, 0, 2228}), compact.browserVersionPacked);
+    EXPECT_LT(uap::packVersion(uap::Version{8, 3}), uap::packVersion(uap::Version{10}));
+
+    // Threads interning the same strings agree on their ids.
+    auto ids = std::vector<std::vector<uint32_t>>(4);
+    auto threads = std::vector<std::thread>();
+    for (auto& threadIds : ids)
+    {
+        threads.emplace_back([&table, &threadIds] {
+            for (int idx = 0; idx < 5000; ++idx)
+            {
+                threadIds.push_back(table.intern(std::to_string(idx)));
+            }
+        });
+    }
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+    for (const auto& threadIds : ids)
+    {
+        EXPECT_EQ(ids.front(), threadIds);
+    }
+    EXPECT_EQ("4321", table.lookup(ids.front()[4321]));
+}
+
+TEST(CachingUaParser, shouldCountHitsMissesAndEvictions)
+{
+    const auto parser = uap::CachingUaParser{2, 1};
+    const auto chrome = std::string{"Mozilla/5.0 (Windows NT 6.1; WOW64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/41.0.2228.0 Safari/537.36"};
+    const auto firefox = std::string{"Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:31.0) Gecko/20100101 Firefox/31.0"};
+    const auto safari = std::string{"Mozilla/5.0 (Macintosh; Intel Mac OS X 10_10_3) AppleWebKit/600.5.17 (KHTML, like Gecko) Version/8.0.5 Safari/600.5.17"};
+
+    const auto uas = std::vector<std::string>{chrome, firefox};
+    parser.warmup(uas.begin(), uas.end());
+    EXPECT_EQ("Chrome", parser.parse(chrome).browserName);
+    EXPECT_EQ("Firefox", parser.parse(firefox).browserName);
+    EXPECT_EQ("Safari", parser.parse(safari).browserName);
+    EXPECT_EQ("Firefox", parser.parse(firefox).browserName);
+
+    const auto stats = parser.stats();
+    EXPECT_EQ(3u, stats.hits);
+    EXPECT_EQ(3u, stats.misses);
+    EXPECT_EQ(1u, stats.evictions);
+    EXPECT_EQ(2u, stats.size);
+
+    // Never more than capacity entries, however many shards were asked for.
+    const auto single = uap::CachingUaParser{1, 16};
+    for (const auto& ua : {chrome, firefox, safari})
+    {
+        single.parse(ua);
+    }
+    EXPECT_EQ(1u, single.stats().size);
+
+#ifndef UAP_REGEX_RE2
+    // Results cut short by the budget are not kept.
+    const auto hostile = std::string{"AppleCoreMedia/1.0.0.12B466 palm_8_3(iPhone; UTizenoka(4.90; CPU OS 8_1_3456, APA like Mac OS XwiDs3PoRtABlevu-x; en_us)"};
+    const auto cut = uap::CachingUaParser{4, 1};
+    EXPECT_TRUE(cut.parse(hostile).budgetExceeded);
+    EXPECT_TRUE(cut.parse(hostile).budgetExceeded);
+    EXPECT_EQ(0u, cut.stats().hits);
+    EXPECT_EQ(0u, cut.stats().size);
+#endif
+}
+
+TEST(CacheFile, shouldServeSavedResultsOfSameRulesOnly)
+{
+    const auto parser = uap::UaParser{};
+    const auto path = ::testing::TempDir() + "ua_parser_cache.bin";
+    std::remove(path.c_str());
+    const auto fixtures = load_json_from_file("test/fixtures.json");
+    {
+        uap::CacheFile cache(path, parser.rulesVersion());
+        EXPECT_EQ(0u, cache.size());
+        for (const auto& fixture : fixtures)
+        {
+            const auto ua = fixture["userAgent"].asString();
+            cache.add(ua, parser.parse(ua));
+        }
+        cache.save(path);
+    }
+
+    uap::CacheFile cache(path, parser.rulesVersion());
+    auto view = uap::UaParser::ResultView();
+    for (const auto& fixture : fixtures)
+    {
+        const auto ua = fixture["userAgent"].asString();
+        const auto expected = parser.parse(ua);
+        ASSERT_TRUE(cache.lookup(ua, view));
+        const auto result = view.toResult();
+        EXPECT_EQ(expected.browserName, result.browserName);
+        EXPECT_EQ(expected.browserVersion, result.browserVersion);
+        EXPECT_EQ(expected.deviceModel, result.deviceModel);
+        EXPECT_EQ(expected.osVersion, result.osVersion);
+        EXPECT_EQ(expected.botName, result.botName);
+        EXPECT_EQ(0, expected.osVersionNumber.compare(result.osVersionNumber));
+    }
+    const auto curl = std::string{"curl/7.68.0"};
+    EXPECT_FALSE(cache.lookup(curl, view));
+    cache.add(curl, parser.parseView(curl));
+    ASSERT_TRUE(cache.lookup(curl, view));
+    EXPECT_TRUE(view.isBot);
+    EXPECT_EQ(cache.size(), uap::CacheFile(path, parser.rulesVersion()).size() + 1);
+
+#ifndef UAP_REGEX_RE2
+    // Results cut short by the budget are not kept.
+    const auto hostile = std::string{"AppleCoreMedia/1.0.0.12B466 palm_8_3(iPhone; UTizenoka(4.90; CPU OS 8_1_3456, APA like Mac OS XwiDs3PoRtABlevu-x; en_us)"};
+    const auto cut = parser.parse(hostile);
+    EXPECT_TRUE(cut.budgetExceeded);
+    cache.add(hostile, cut);
+    EXPECT_FALSE(cache.lookup(hostile, view));
+#endif
+
+    // Other rules see an empty cache, and a damaged file is refused.
+    const uap::CacheFile stale(path, parser.rulesVersion() + 1);
+    EXPECT_EQ(0u, stale.size());
+    EXPECT_FALSE(stale.lookup(fixtures[0]["userAgent"].asString(), view));
+    {
+        std::ofstream out{path, std::ios::binary | std::ios::in};
+        out.seekp(40); // the first slot's entry index
+        out << "garbage";
+    }
+    EXPECT_THROW(uap::CacheFile(path, parser.rulesVersion()), std::runtime_error);
+}
+
+TEST(ThreadPool, shouldParseBatchLikeSerialLoop)
+{
+    const auto parser = uap::UaParser{};
+    const auto fixtures = load_json_from_file("test/fixtures.json");
+    auto userAgents = std::vector<std::string>();
+    for (const auto& fixture : fixtures)
+    {
+        userAgents.push_back(fixture["userAgent"].asString());
+    }
+    const auto views = std::vector<uap::StringView>(userAgents.begin(), userAgents.end());
+
+    uap::ThreadPool pool{3};
+    auto results = std::vector<uap::UaParser::Result>(views.size());
+    uap::parseBatch(parser, pool, views.data(), views.size(), results.data(), 2);
+    for (size_t idx = 0; idx < views.size(); ++idx)
+    {
+        const auto expected = parser.parse(userAgents[idx]);
+        EXPECT_EQ(expected.browserName, results[idx].browserName);
+        EXPECT_EQ(expected.osName, results[idx].osName);
+        EXPECT_EQ(expected.deviceModel, results[idx].deviceModel);
+    }
+}
+
+TEST(ThreadPool, shouldParseEveryDistinctUaOnce)
+{
+    const auto parser = uap::UaParser{};
+    const auto chrome = std::string{"Mozilla/5.0 (Windows NT 6.1; WOW64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/41.0.2228.0 Safari/537.36"};
+    const auto firefox = std::string{"Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:31.0) Gecko/20100101 Firefox/31.0"};
+    const auto curl = std::string{"curl/7.68.0"};
+    const auto views = std::vector<uap::StringView>{chrome, firefox, chrome, curl, firefox, chrome};
+
+    uap::ThreadPool pool{2};
+    const auto distinct = uap::parseDistinct(parser, pool, views.data(), views.size(), 1);
+    ASSERT_EQ(3u, distinct.results.size());
+    EXPECT_EQ((std::vector<uint32_t>{0, 1, 0, 2, 1, 0}), distinct.index);
+    EXPECT_EQ("Chrome", distinct.results[0].browserName);
+    EXPECT_EQ("Firefox", distinct.results[1].browserName);
+    EXPECT_EQ("curl", distinct.results[2].botName);
+
+    auto results = std::vector<uap::UaParser::Result>(views.size());
+    uap::parseBatchDistinct(parser, pool, views.data(), views.size(), results.data());
+    for (size_t idx = 0; idx < views.size(); ++idx)
+    {
+        const auto expected = parser.parseView(views[idx]).toResult();
+        EXPECT_EQ(expected.browserName, results[idx].browserName);
+        EXPECT_EQ(expected.browserVersion, results[idx].browserVersion);
+        EXPECT_EQ(expected.osName, results[idx].osName);
+    }
+}
+
 int main(int argc, char** argv)
 {
     ::testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,431 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/functional/hash.hpp>
+
+#include "ua_parser.hpp"
+#include "ua_parser_batch.hpp"
+#include "ua_parser_cache_file.hpp"
+
+// Parses the UA column of a log, one record per line, on all cores. Every
+// distinct UA of a block of lines is parsed once.
+//
+//   ua_parse [-d delimiter] [-f field] [-j threads] [-c] [-k cache] [file]
+//
+// Without -f the whole line is the UA; with it, field is the 0-based index
+// among the delimiter-separated fields (tab by default), so for the combined
+// log format "-d '\"' -f 5" picks the UA. Input is the file, memory-mapped,
+// or stdin. Output goes to stdout as TSV with a header row or, with -c, in
+// the columnar format below: a header, then one row group per block of
+// input lines, every field dictionary-encoded within its row group. All
+// integers are uint32 in host byte order, strings are a length and bytes.
+// With -k, results are also looked up in and saved to the cache file, so
+// reruns over the same logs only parse UAs no run has seen before.
+//
+//   header:    "UAPC" version fieldCount name...
+//   row group: rowCount, then per field: dictionarySize string... id[rowCount]
+
+namespace
+{
+
+using Result = uap::UaParser::Result;
+
+const uint32_t COLUMNAR_VERSION = 1;
+const size_t BLOCK_LINES = 64 * 1024;
+
+struct Column
+{
+    const char* name;
+    std::string Result::*field;
+};
+
+const Column COLUMNS[] = {
+    {"browserName", &Result::browserName},
+    {"browserUnit", &Result::browserUnit},
+    {"browserVersion", &Result::browserVersion},
+    {"cpuArchitecture", &Result::cpuArchitecture},
+    {"deviceType", &Result::deviceType},
+    {"deviceModel", &Result::deviceModel},
+    {"deviceVendor", &Result::deviceVendor},
+    {"engineName", &Result::engineName},
+    {"engineVersion", &Result::engineVersion},
+    {"osName", &Result::osName},
+    {"osVersion", &Result::osVersion},
+};
+
+struct Options
+{
+    char delimiter = '\t';
+    long field = -1;
+    size_t threads = 0;
+    bool columnar = false;
+    const char* cachePath = nullptr;
+    const char* path = nullptr;
+};
+
+// Hands out the input a block of lines at a time. Lines stay valid until
+// the next call.
+struct Input
+{
+public:
+    explicit Input(const char* path)
+    : data_(nullptr)
+    , size_(0)
+    , pos_(0)
+    , mapped_(false)
+    , buffer_()
+    , offsets_()
+    {
+        if (!path)
+        {
+            return;
+        }
+        const auto fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+        {
+            throw std::runtime_error(std::string("Cannot open ") + path);
+        }
+        struct stat info;
+        if (::fstat(fd, &info) == 0 && info.st_size > 0)
+        {
+            size_ = static_cast<size_t>(info.st_size);
+            auto* data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED)
+            {
+                ::close(fd);
+                throw std::runtime_error(std::string("Cannot map ") + path);
+            }
+            ::madvise(data, size_, MADV_SEQUENTIAL);
+            data_ = static_cast<const char*>(data);
+        }
+        ::close(fd);
+        mapped_ = true;
+    }
+
+    Input(const Input&) = delete;
+    Input& operator=(const Input&) = delete;
+
+    ~Input()
+    {
+        if (data_)
+        {
+            ::munmap(const_cast<char*>(data_), size_);
+        }
+    }
+
+    bool next(std::vector<uap::StringView>& lines)
+    {
+        lines.clear();
+        if (mapped_)
+        {
+            while (lines.size() < BLOCK_LINES && pos_ < size_)
+            {
+                const auto* begin = data_ + pos_;
+                const auto* end = static_cast<const char*>(std::memchr(begin, '\n', size_ - pos_));
+                const auto length = end ? static_cast<size_t>(end - begin) : size_ - pos_;
+                lines.push_back(trim(uap::StringView(begin, length)));
+                pos_ += length + 1;
+            }
+            return !lines.empty();
+        }
+
+        buffer_.clear();
+        offsets_.assign(1, 0);
+        char* line = nullptr;
+        size_t capacity = 0;
+        while (offsets_.size() <= BLOCK_LINES)
+        {
+            const auto length = ::getline(&line, &capacity, stdin);
+            if (length < 0)
+            {
+                break;
+            }
+            buffer_.append(line, static_cast<size_t>(length));
+            offsets_.push_back(buffer_.size());
+        }
+        std::free(line);
+        for (size_t idx = 1; idx < offsets_.size(); ++idx)
+        {
+            const auto begin = offsets_[idx - 1];
+            lines.push_back(trim(uap::StringView(buffer_).substr(begin, offsets_[idx] - begin)));
+        }
+        return !lines.empty();
+    }
+
+private:
+    static uap::StringView trim(uap::StringView line)
+    {
+        while (!line.empty() && (line.back() == '\n' || line.back() == '\r'))
+        {
+            line.remove_suffix(1);
+        }
+        return line;
+    }
+
+private:
+    const char* data_;
+    size_t size_;
+    size_t pos_;
+    bool mapped_;
+    std::string buffer_;
+    std::vector<size_t> offsets_;
+};
+
+uap::StringView selectField(uap::StringView line, const Options& options)
+{
+    if (options.field < 0)
+    {
+        return line;
+    }
+    for (long idx = 0; idx < options.field; ++idx)
+    {
+        const auto pos = line.find(options.delimiter);
+        if (pos == uap::StringView::npos)
+        {
+            return uap::StringView();
+        }
+        line.remove_prefix(pos + 1);
+    }
+    return line.substr(0, line.find(options.delimiter));
+}
+
+// Parses only the distinct UAs the cache lacks, and adds them to it;
+// CacheFile::add() leaves out results cut short by the time budget.
+size_t parseCached(const uap::UaParser& parser,
+                   uap::ThreadPool& pool,
+                   uap::CacheFile& cache,
+                   const std::vector<uap::StringView>& uas,
+                   std::vector<Result>& results)
+{
+    auto misses = std::vector<uap::StringView>();
+    auto positions = std::vector<size_t>();
+    auto view = uap::UaParser::ResultView();
+    for (size_t idx = 0; idx < uas.size(); ++idx)
+    {
+        if (cache.lookup(uas[idx], view))
+        {
+            view.assignTo(results[idx]);
+            continue;
+        }
+        misses.push_back(uas[idx]);
+        positions.push_back(idx);
+    }
+    const auto parsed = uap::parseDistinct(parser, pool, misses.data(), misses.size());
+    for (size_t idx = 0; idx < misses.size(); ++idx)
+    {
+        const auto& result = parsed.results[parsed.index[idx]];
+        cache.add(misses[idx], result);
+        results[positions[idx]] = result;
+    }
+    return parsed.results.size();
+}
+
+void write(const std::string& bytes)
+{
+    if (std::fwrite(bytes.data(), 1, bytes.size(), stdout) != bytes.size())
+    {
+        throw std::runtime_error("Cannot write output");
+    }
+}
+
+void appendUint(std::string& out, const uint32_t value)
+{
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void appendString(std::string& out, const std::string& value)
+{
+    appendUint(out, static_cast<uint32_t>(value.size()));
+    out += value;
+}
+
+void writeTsvHeader()
+{
+    auto out = std::string();
+    for (const auto& column : COLUMNS)
+    {
+        out += out.empty() ? "" : "\t";
+        out += column.name;
+    }
+    write(out + "\n");
+}
+
+// Tabs and line breaks would shift the columns, so they become spaces.
+void writeTsv(const std::vector<Result>& results, const size_t count)
+{
+    auto out = std::string();
+    for (size_t row = 0; row < count; ++row)
+    {
+        for (size_t col = 0; col < sizeof(COLUMNS) / sizeof(COLUMNS[0]); ++col)
+        {
+            if (col != 0)
+            {
+                out += '\t';
+            }
+            for (const auto ch : results[row].*COLUMNS[col].field)
+            {
+                out += ch == '\t' || ch == '\n' || ch == '\r' ? ' ' : ch;
+            }
+        }
+        out += '\n';
+    }
+    write(out);
+}
+
+void writeColumnarHeader()
+{
+    auto out = std::string("UAPC");
+    appendUint(out, COLUMNAR_VERSION);
+    appendUint(out, sizeof(COLUMNS) / sizeof(COLUMNS[0]));
+    for (const auto& column : COLUMNS)
+    {
+        appendString(out, column.name);
+    }
+    write(out);
+}
+
+void writeColumnar(const std::vector<Result>& results, const size_t count)
+{
+    auto out = std::string();
+    appendUint(out, static_cast<uint32_t>(count));
+    auto ids = std::vector<uint32_t>(count);
+    for (const auto& column : COLUMNS)
+    {
+        auto dictionary = std::unordered_map<uap::StringView, uint32_t, boost::hash<uap::StringView>>();
+        auto values = std::vector<const std::string*>();
+        for (size_t row = 0; row < count; ++row)
+        {
+            const auto& value = results[row].*column.field;
+            const auto inserted = dictionary.emplace(value, static_cast<uint32_t>(values.size()));
+            if (inserted.second)
+            {
+                values.push_back(&value);
+            }
+            ids[row] = inserted.first->second;
+        }
+        appendUint(out, static_cast<uint32_t>(values.size()));
+        for (const auto* value : values)
+        {
+            appendString(out, *value);
+        }
+        out.append(reinterpret_cast<const char*>(ids.data()), ids.size() * sizeof(uint32_t));
+    }
+    write(out);
+}
+
+void usage(const char* program)
+{
+    std::fprintf(stderr, "usage: %s [-d delimiter] [-f field] [-j threads] [-c] [-k cache] [file]\n", program);
+    std::exit(2);
+}
+
+Options parseOptions(int argc, char** argv)
+{
+    auto options = Options();
+    int opt;
+    while ((opt = ::getopt(argc, argv, "d:f:j:ck:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            if (std::strlen(optarg) != 1)
+            {
+                usage(argv[0]);
+            }
+            options.delimiter = optarg[0];
+            break;
+        case 'f':
+            options.field = std::strtol(optarg, nullptr, 10);
+            break;
+        case 'j':
+            options.threads = std::strtoul(optarg, nullptr, 10);
+            break;
+        case 'c':
+            options.columnar = true;
+            break;
+        case 'k':
+            options.cachePath = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind + 1 < argc)
+    {
+        usage(argv[0]);
+    }
+    options.path = optind < argc ? argv[optind] : nullptr;
+    return options;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    const auto options = parseOptions(argc, argv);
+    try
+    {
+        const auto parser = uap::UaParser{};
+        parser.warmup();
+        uap::ThreadPool pool{options.threads != 0 ? options.threads : std::thread::hardware_concurrency()};
+        Input input(options.path);
+        auto cache = std::unique_ptr<uap::CacheFile>(
+            options.cachePath ? new uap::CacheFile(options.cachePath, parser.rulesVersion()) : nullptr);
+
+        options.columnar ? writeColumnarHeader() : writeTsvHeader();
+        auto lines = std::vector<uap::StringView>();
+        auto uas = std::vector<uap::StringView>();
+        auto results = std::vector<Result>();
+        size_t total = 0;
+        size_t parsed = 0;
+        while (input.next(lines))
+        {
+            uas.clear();
+            for (const auto& line : lines)
+            {
+                uas.push_back(selectField(line, options));
+            }
+            results.resize(std::max(results.size(), uas.size()));
+            total += uas.size();
+            if (cache)
+            {
+                parsed += parseCached(parser, pool, *cache, uas, results);
+            }
+            else
+            {
+                uap::parseBatchDistinct(parser, pool, uas.data(), uas.size(), results.data());
+            }
+            options.columnar ? writeColumnar(results, uas.size()) : writeTsv(results, uas.size());
+        }
+        if (std::fflush(stdout) != 0)
+        {
+            throw std::runtime_error("Cannot write output");
+        }
+        if (cache)
+        {
+            cache->save(options.cachePath);
+            std::fprintf(stderr, "parsed %zu of %zu UAs, %zu cached\n", parsed, total, cache->size());
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,103 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "ua_parser.hpp"
+#include "uap_tool_input.hpp"
+
+// Checks UaParser::getImplications() against a traffic sample: parses the
+// sample and the fixtures with and without implications, lists the UAs on
+// which they disagree and exits non-zero if there are any.
+//
+//   uap_implications [-x fixtures.json] sample.txt
+
+namespace
+{
+
+// Average over a few passes, the sample being small enough to be noisy.
+double parseMicros(const uap::UaParser& parser, const std::vector<std::string>& uas, const size_t sampleSize)
+{
+    const auto passes = 20;
+    const auto start = std::chrono::steady_clock::now();
+    for (auto pass = 0; pass < passes; ++pass)
+    {
+        for (size_t idx = 0; idx < sampleSize; ++idx)
+        {
+            parser.parseView(uas[idx]);
+        }
+    }
+    const auto elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start);
+    return sampleSize != 0 ? elapsed.count() / passes / sampleSize : 0;
+}
+
+void usage(const char* program)
+{
+    std::fprintf(stderr, "usage: %s [-x fixtures.json] sample.txt\n", program);
+    std::exit(2);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    auto fixturesPath = std::string("test/fixtures.json");
+    int opt;
+    while ((opt = ::getopt(argc, argv, "x:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'x':
+            fixturesPath = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind + 1 != argc)
+    {
+        usage(argv[0]);
+    }
+
+    try
+    {
+        auto uas = uap::tools::readLines(argv[optind]);
+        const auto sampleSize = uas.size();
+        const auto fixtures = uap::tools::readFixtures(fixturesPath);
+        uas.insert(uas.end(), fixtures.begin(), fixtures.end());
+
+        const auto plain = uap::UaParser{};
+        plain.warmup();
+        auto implied = plain;
+        implied.enableImplications();
+
+        size_t mismatches = 0;
+        for (const auto& ua : uas)
+        {
+            if (plain.parse(ua) != implied.parse(ua))
+            {
+                ++mismatches;
+                std::printf("%s\n", ua.c_str());
+            }
+        }
+        if (mismatches != 0)
+        {
+            std::fprintf(stderr, "implications change the result of %zu of %zu UAs\n", mismatches, uas.size());
+            return 1;
+        }
+        std::printf("verified on %zu UAs; sample parse time %.2fus -> %.2fus per UA\n",
+                    uas.size(),
+                    parseMicros(plain, uas, sampleSize),
+                    parseMicros(implied, uas, sampleSize));
+    }
+    catch (const std::exception& e)
+    {
+        std::fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,188 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+#include "ua_parser.hpp"
+#include "uap_tool_input.hpp"
+
+// Reorders the rules of every group so that the ones winning most often in
+// a traffic sample are tried first, and writes the result as a rule file
+// for UaParser::loadRules().
+//
+//   uap_reorder [-x fixtures.json] -o rules.bin sample.txt
+//
+// The first match wins, so a rule may only move ahead of another if no UA
+// matches both. Which pairs overlap is taken from the sample and the
+// fixtures: for every UA the rule that wins stays ahead of every other
+// rule matching it, and rules never seen together are treated as mutually
+// exclusive. Among the rules this leaves free to go first, the most
+// frequent winner goes first. The reordered rules then have to parse the
+// sample and the fixtures exactly like the original ones, or nothing is
+// written.
+
+namespace
+{
+
+using Order = std::vector<std::vector<size_t>>;
+
+// Orders one group's rules: precedes[a] lists the rules that have to come
+// after a, wins[a] how often a won in the sample.
+std::vector<size_t> orderGroup(const std::vector<std::vector<bool>>& precedes, const std::vector<size_t>& wins)
+{
+    const auto count = wins.size();
+    auto blockers = std::vector<size_t>(count, 0);
+    for (size_t before = 0; before < count; ++before)
+    {
+        for (size_t after = 0; after < count; ++after)
+        {
+            blockers[after] += precedes[before][after];
+        }
+    }
+    auto order = std::vector<size_t>();
+    auto placed = std::vector<bool>(count, false);
+    while (order.size() < count)
+    {
+        auto best = count;
+        for (size_t rule = 0; rule < count; ++rule)
+        {
+            if (!placed[rule] && blockers[rule] == 0 && (best == count || wins[rule] > wins[best]))
+            {
+                best = rule;
+            }
+        }
+        placed[best] = true;
+        order.push_back(best);
+        for (size_t after = 0; after < count; ++after)
+        {
+            blockers[after] -= precedes[best][after];
+        }
+    }
+    return order;
+}
+
+// Constraints only ever point from a lower to a higher rule index, so
+// every group can be ordered.
+Order optimizeOrder(const uap::UaParser& parser, const std::vector<std::string>& uas, const size_t sampleSize)
+{
+    const auto ruleCounts = parser.ruleCounts();
+    auto order = Order();
+    for (size_t groupIdx = 0; groupIdx < ruleCounts.size(); ++groupIdx)
+    {
+        const auto count = ruleCounts[groupIdx];
+        auto precedes = std::vector<std::vector<bool>>(count, std::vector<bool>(count, false));
+        auto wins = std::vector<size_t>(count, 0);
+        for (size_t idx = 0; idx < uas.size(); ++idx)
+        {
+            const auto matching = parser.matchingRules(uas[idx], groupIdx);
+            const auto winner = std::find(matching.begin(), matching.end(), true) - matching.begin();
+            if (static_cast<size_t>(winner) == count)
+            {
+                continue;
+            }
+            wins[winner] += idx < sampleSize;
+            for (auto other = static_cast<size_t>(winner) + 1; other < count; ++other)
+            {
+                precedes[winner][other] = precedes[winner][other] || matching[other];
+            }
+        }
+        order.push_back(orderGroup(precedes, wins));
+    }
+    return order;
+}
+
+double parseSeconds(const uap::UaParser& parser, const std::vector<std::string>& uas, const size_t sampleSize)
+{
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t idx = 0; idx < sampleSize; ++idx)
+    {
+        parser.parseView(uas[idx]);
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void usage(const char* program)
+{
+    std::fprintf(stderr, "usage: %s [-x fixtures.json] -o rules.bin sample.txt\n", program);
+    std::exit(2);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    auto fixturesPath = std::string("test/fixtures.json");
+    auto outputPath = std::string();
+    int opt;
+    while ((opt = ::getopt(argc, argv, "x:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'x':
+            fixturesPath = optarg;
+            break;
+        case 'o':
+            outputPath = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (outputPath.empty() || optind + 1 != argc)
+    {
+        usage(argv[0]);
+    }
+
+    try
+    {
+        auto uas = uap::tools::readLines(argv[optind]);
+        const auto sampleSize = uas.size();
+        const auto fixtures = uap::tools::readFixtures(fixturesPath);
+        uas.insert(uas.end(), fixtures.begin(), fixtures.end());
+
+        const auto original = uap::UaParser{};
+        original.warmup();
+        const auto order = optimizeOrder(original, uas, sampleSize);
+        auto reordered = uap::UaParser{};
+        reordered.reorderRules(order);
+        reordered.warmup();
+
+        size_t mismatches = 0;
+        for (const auto& ua : uas)
+        {
+            mismatches += original.parse(ua) != reordered.parse(ua);
+        }
+        if (mismatches != 0)
+        {
+            std::fprintf(stderr, "reordered rules disagree on %zu of %zu UAs, nothing written\n", mismatches, uas.size());
+            return 1;
+        }
+
+        for (size_t groupIdx = 0; groupIdx < order.size(); ++groupIdx)
+        {
+            std::printf("group %zu:", groupIdx);
+            for (const auto rule : order[groupIdx])
+            {
+                std::printf(" %zu", rule);
+            }
+            std::printf("\n");
+        }
+        std::printf("verified on %zu UAs; sample parse time %.3fs -> %.3fs\n",
+                    uas.size(),
+                    parseSeconds(original, uas, sampleSize),
+                    parseSeconds(reordered, uas, sampleSize));
+        reordered.saveRules(outputPath);
+    }
+    catch (const std::exception& e)
+    {
+        std::fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,38 @@
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+
+#include "ua_parser.hpp"
+
+// Writes the rules compiled into ua_parser.hpp to a rule file for
+// UaParser::loadRules(), or prints the version of an existing one. Rebuild
+// this with the updated header to roll out new rules without rebuilding the
+// services that parse with them.
+int main(int argc, char** argv)
+{
+    if (argc != 3 || (std::strcmp(argv[1], "save") != 0 && std::strcmp(argv[1], "version") != 0))
+    {
+        std::fprintf(stderr, "usage: %s save|version <rule file>\n", argv[0]);
+        return 2;
+    }
+    try
+    {
+        auto parser = uap::UaParser{};
+        if (std::strcmp(argv[1], "save") == 0)
+        {
+            parser.saveRules(argv[2]);
+        }
+        else
+        {
+            parser.loadRules(argv[2]);
+        }
+        std::printf("%016" PRIx64 "\n", parser.rulesVersion());
+    }
+    catch (const std::exception& e)
+    {
+        std::fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
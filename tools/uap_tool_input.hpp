@@ -0,0 +1,65 @@
+#pragma once
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <json/reader.h>
+#include <json/value.h>
+
+// Reading the UA samples and fixtures the tools check rules against.
+
+namespace uap
+{
+namespace tools
+{
+
+// One UA per line, a trailing '\r' dropped.
+inline std::vector<std::string> readLines(const std::string& path)
+{
+    std::ifstream in{path};
+    if (!in.is_open())
+    {
+        throw std::runtime_error("Cannot open " + path);
+    }
+    auto lines = std::vector<std::string>();
+    auto line = std::string();
+    while (std::getline(in, line))
+    {
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.pop_back();
+        }
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+// The UAs of a fixtures file laid out like test/fixtures.json.
+inline std::vector<std::string> readFixtures(const std::string& path)
+{
+    std::ifstream in{path};
+    if (!in.is_open())
+    {
+        throw std::runtime_error("Cannot open " + path);
+    }
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    Json::Value json;
+    Json::Reader reader;
+    if (!reader.parse(buffer.str(), json))
+    {
+        throw std::runtime_error("Error parsing json: " + reader.getFormattedErrorMessages());
+    }
+    auto uas = std::vector<std::string>();
+    for (const auto& fixture : json)
+    {
+        uas.push_back(fixture["userAgent"].asString());
+    }
+    return uas;
+}
+
+} // namespace tools
+} // namespace uap
@@ -1,12 +1,41 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <regex>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <boost/optional.hpp>
 #include <boost/regex.hpp>
+#include <boost/utility/string_view.hpp>
+
+#ifdef UAP_REGEX_RE2
+#include <re2/re2.h>
+#endif
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 namespace uap
 {
@@ -14,6 +43,125 @@ namespace uap
 // std::regex implementation is insanely slow, so use boost::regex for now.
 namespace RegexImpl = ::boost;
 
+using StringView = ::boost::string_view;
+
+// FNV-1a; cheap enough to run once per lookup and good enough to spread
+// UAs over cache shards and buckets, or to checksum a rule file.
+inline uint64_t fnv1a(StringView bytes)
+{
+    auto hash = uint64_t{14695981039346656037ull};
+    for (const auto ch : bytes)
+    {
+        hash ^= static_cast<unsigned char>(ch);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Bit per Result field, for callers that only need some of them; the
+// per-group masks cover every field a group of rules describes.
+struct Fields
+{
+    enum : uint32_t
+    {
+        BrowserName = 1u << 0,
+        BrowserUnit = 1u << 1,
+        BrowserVersion = 1u << 2,
+        CpuArchitecture = 1u << 3,
+        DeviceType = 1u << 4,
+        DeviceModel = 1u << 5,
+        DeviceVendor = 1u << 6,
+        EngineName = 1u << 7,
+        EngineVersion = 1u << 8,
+        OsName = 1u << 9,
+        OsVersion = 1u << 10,
+
+        Browser = BrowserName | BrowserUnit | BrowserVersion,
+        Cpu = CpuArchitecture,
+        Device = DeviceType | DeviceModel | DeviceVendor,
+        Engine = EngineName | EngineVersion,
+        Os = OsName | OsVersion,
+        All = Browser | Cpu | Device | Engine | Os,
+    };
+};
+
+using FieldMask = uint32_t;
+
+// Numeric components of a version string such as "41.0.2228.0" or iOS's
+// "8_3", for comparisons like "Chrome >= 90" without tokenizing the
+// string again. Missing components are 0.
+struct Version
+{
+    uint32_t major = 0;
+    uint32_t minor = 0;
+    uint32_t patch = 0;
+    uint32_t build = 0;
+
+    // Reads up to four runs of digits separated by '.' or '_' and stops at
+    // anything else; components too large for 32 bits saturate.
+    static Version parse(StringView text)
+    {
+        auto version = Version();
+        uint32_t* const components[] = {&version.major, &version.minor, &version.patch, &version.build};
+        size_t pos = 0;
+        for (auto* component : components)
+        {
+            uint64_t value = 0;
+            while (pos < text.size() && text[pos] >= '0' && text[pos] <= '9')
+            {
+                value = std::min<uint64_t>(value * 10 + (text[pos] - '0'), std::numeric_limits<uint32_t>::max());
+                ++pos;
+            }
+            *component = static_cast<uint32_t>(value);
+            if (pos >= text.size() || (text[pos] != '.' && text[pos] != '_'))
+            {
+                break;
+            }
+            ++pos;
+        }
+        return version;
+    }
+
+    int compare(const Version& other) const
+    {
+        const uint32_t lhs[] = {major, minor, patch, build};
+        const uint32_t rhs[] = {other.major, other.minor, other.patch, other.build};
+        for (size_t idx = 0; idx < 4; ++idx)
+        {
+            if (lhs[idx] != rhs[idx])
+            {
+                return lhs[idx] < rhs[idx] ? -1 : 1;
+            }
+        }
+        return 0;
+    }
+
+    bool operator==(const Version& other) const
+    {
+        return compare(other) == 0;
+    }
+    bool operator!=(const Version& other) const
+    {
+        return compare(other) != 0;
+    }
+    bool operator<(const Version& other) const
+    {
+        return compare(other) < 0;
+    }
+    bool operator<=(const Version& other) const
+    {
+        return compare(other) <= 0;
+    }
+    bool operator>(const Version& other) const
+    {
+        return compare(other) > 0;
+    }
+    bool operator>=(const Version& other) const
+    {
+        return compare(other) >= 0;
+    }
+};
+
 struct UaParser
 {
 public:
@@ -30,33 +178,571 @@ public:
         std::string engineVersion;
         std::string osName;
         std::string osVersion;
+        Version browserVersionNumber; // the version fields above, parsed
+        Version engineVersionNumber;
+        Version osVersionNumber;
+        bool truncated = false;      // only a prefix of the UA was parsed
+        bool budgetExceeded = false; // some rule groups were skipped
+        bool isBot = false;          // an automated agent getBots() knows
+        std::string botName;         // empty for bots only known by a generic token
+
+        // The parsed versions follow from the version fields, so they are
+        // left out.
+        bool operator==(const Result& other) const
+        {
+            return browserName == other.browserName && browserUnit == other.browserUnit &&
+                   browserVersion == other.browserVersion && cpuArchitecture == other.cpuArchitecture &&
+                   deviceType == other.deviceType && deviceModel == other.deviceModel &&
+                   deviceVendor == other.deviceVendor && engineName == other.engineName &&
+                   engineVersion == other.engineVersion && osName == other.osName && osVersion == other.osVersion &&
+                   botName == other.botName && truncated == other.truncated &&
+                   budgetExceeded == other.budgetExceeded && isBot == other.isBot;
+        }
+
+        bool operator!=(const Result& other) const
+        {
+            return !(*this == other);
+        }
+    };
+
+    // What a parse does about UAs getBots() recognizes: nothing, set isBot
+    // and botName on top of the other fields, or set only those two and
+    // skip the rules altogether.
+    enum class BotHandling
+    {
+        Ignore,
+        Detect,
+        ShortCircuit,
     };
 
-    Result parse(const std::string& ua) const
+    // Buffers a parse needs besides the result: the lowercased UA, the
+    // delimiter bitmaps, the prefilter's candidates, boost's match results
+    // and the values formatters synthesize. Parsing with a context that has
+    // seen a few UAs before allocates nothing. One per thread; the
+    // overloads taking none use one of their own per thread.
+    struct ParseContext
     {
-        auto result = Result();
+    private:
+        friend struct UaParser;
+
+        std::string folded_;
+        std::vector<uint64_t> delimiters_;
+        std::vector<bool> candidates_;
+        std::vector<bool> skipped_; // rules ruled out by an implication
+        RegexImpl::cmatch matches_;
+        std::deque<std::string> scratch_; // never moves its elements
+        size_t scratchUsed_ = 0;
 
-        for (const auto matcherGroup : getMatcherGroups())
+    private:
+        std::string& scratch(StringView value)
         {
-            for (const auto matcher : matcherGroup)
+            if (scratchUsed_ == scratch_.size())
             {
-                if (matcher(ua, result))
-                {
-                    break;
-                }
+                scratch_.emplace_back();
+            }
+            auto& slot = scratch_[scratchUsed_++];
+            slot.assign(value.data(), value.size());
+            return slot;
+        }
+    };
+
+    // Same fields as Result, but borrowed: every view points either into the
+    // parsed UA or into static storage. Values a formatter had to synthesize
+    // are kept alive by the view itself, so it stays valid as long as the UA
+    // it was parsed from, copies included.
+    struct ResultView
+    {
+    public:
+        StringView browserName;
+        StringView browserUnit;
+        StringView browserVersion;
+        StringView cpuArchitecture;
+        StringView deviceType;
+        StringView deviceModel;
+        StringView deviceVendor;
+        StringView engineName;
+        StringView engineVersion;
+        StringView osName;
+        StringView osVersion;
+        Version browserVersionNumber;
+        Version engineVersionNumber;
+        Version osVersionNumber;
+        bool truncated = false;
+        bool budgetExceeded = false;
+        bool isBot = false;
+        StringView botName;
+
+    public:
+        Result toResult() const
+        {
+            auto result = Result();
+            assignTo(result);
+            return result;
+        }
+
+        // Overwrites every field of result, reusing the strings' capacity.
+        void assignTo(Result& result) const
+        {
+            result.browserName.assign(browserName.data(), browserName.size());
+            result.browserUnit.assign(browserUnit.data(), browserUnit.size());
+            result.browserVersion.assign(browserVersion.data(), browserVersion.size());
+            result.cpuArchitecture.assign(cpuArchitecture.data(), cpuArchitecture.size());
+            result.deviceType.assign(deviceType.data(), deviceType.size());
+            result.deviceModel.assign(deviceModel.data(), deviceModel.size());
+            result.deviceVendor.assign(deviceVendor.data(), deviceVendor.size());
+            result.engineName.assign(engineName.data(), engineName.size());
+            result.engineVersion.assign(engineVersion.data(), engineVersion.size());
+            result.osName.assign(osName.data(), osName.size());
+            result.osVersion.assign(osVersion.data(), osVersion.size());
+            result.browserVersionNumber = browserVersionNumber;
+            result.engineVersionNumber = engineVersionNumber;
+            result.osVersionNumber = osVersionNumber;
+            result.truncated = truncated;
+            result.budgetExceeded = budgetExceeded;
+            result.isBot = isBot;
+            result.botName.assign(botName.data(), botName.size());
+        }
+
+    private:
+        friend struct UaParser;
+
+        // A copy of value for a formatter to rewrite in place, kept alive
+        // by the view or, for views parsed with a context, by the context.
+        std::string& store(StringView value)
+        {
+            if (context_)
+            {
+                return context_->scratch(value);
             }
+            auto stored = std::make_shared<std::string>(value.data(), value.size());
+            storage_.push_back(stored);
+            return *stored;
+        }
+
+    private:
+        std::vector<std::shared_ptr<const std::string>> storage_;
+        ParseContext* context_ = nullptr;
+    };
+
+    // Caps on the work a single parse may do, since the UA is attacker
+    // controlled. UAs longer than maxLength bytes are cut to that length
+    // before parsing. timeBudget is checked per rule, before each regex
+    // search: once it has passed, the rule group being parsed and all
+    // later ones are skipped and their fields left empty; the same happens
+    // when the regex engine gives up on an expression. It is not a bound
+    // on parse time, as a search that has started runs to the end: with
+    // boost, a hostile UA can overrun a 1ms budget several times over,
+    // bounded only by maxLength and boost's own complexity limit. The RE2
+    // backend searches in linear time. Zero disables a limit; UaParser()
+    // sets neither.
+    struct Limits
+    {
+        size_t maxLength;
+        std::chrono::microseconds timeBudget;
+    };
+
+    // How often the limits kicked in, summed over all copies of a parser.
+    struct LimitStats
+    {
+        uint64_t truncated;
+        uint64_t budgetExceeded;
+    };
+
+    // What getting the rules in use ready has cost so far: building the
+    // rule table, then compiling each expression the first time a parse
+    // needed it.
+    struct CompileStats
+    {
+        size_t expressions;
+        size_t compiled;
+        std::chrono::microseconds buildTime;
+        std::chrono::microseconds compileTime;
+    };
+
+    // What one expression of the rules in use cost so far, counted only in
+    // builds with -DUAP_RULE_STATS. Attempts are the searches that ran,
+    // i.e. those the prefilter let through; searchTime is their total.
+    struct ExpressionStats
+    {
+        size_t group;
+        size_t rule; // within the group
+        std::string pattern;
+        uint64_t attempts;
+        uint64_t hits;
+        std::chrono::nanoseconds searchTime;
+    };
+
+public:
+    UaParser()
+    : UaParser(Limits{0, std::chrono::microseconds{0}})
+    {
+    }
+
+    explicit UaParser(const Limits& limits)
+    : limits_(limits)
+    , counters_(std::make_shared<Counters>())
+    , rules_(std::make_shared<RuleSlot>(builtinRules()))
+    {
+    }
+
+    LimitStats limitStats() const
+    {
+        return LimitStats{counters_->truncated.load(), counters_->budgetExceeded.load()};
+    }
+
+    // Expressions are compiled when a parse first needs them; this compiles
+    // all of them up front, for services that would rather pay at startup.
+    void warmup() const
+    {
+        const auto reader = rules_->read();
+        reader.rules().table.warmup();
+    }
+
+    CompileStats compileStats() const
+    {
+        using std::chrono::duration_cast;
+        using std::chrono::microseconds;
+
+        const auto reader = rules_->read();
+        const auto& rules = reader.rules();
+        return CompileStats{rules.table.expressions().size(),
+                            rules.table.compiledCount(),
+                            duration_cast<microseconds>(rules.buildTime),
+                            duration_cast<microseconds>(rules.table.compileTime())};
+    }
+
+    // One entry per expression, in rule table order, summed over all
+    // threads; empty unless built with -DUAP_RULE_STATS.
+    std::vector<ExpressionStats> ruleStats() const
+    {
+        const auto reader = rules_->read();
+        return reader.rules().table.stats();
+    }
+
+    // ruleStats() as a table, the most expensive expressions first.
+    std::string ruleStatsReport() const
+    {
+        auto stats = ruleStats();
+        std::stable_sort(stats.begin(), stats.end(), [](const ExpressionStats& lhs, const ExpressionStats& rhs) {
+            return lhs.searchTime > rhs.searchTime;
+        });
+        auto report = std::string("group\trule\tattempts\thits\ttime_us\tavg_ns\tpattern\n");
+        for (const auto& expression : stats)
+        {
+            const auto nanos = static_cast<uint64_t>(expression.searchTime.count());
+            report += std::to_string(expression.group) + '\t' + std::to_string(expression.rule) + '\t' +
+                      std::to_string(expression.attempts) + '\t' + std::to_string(expression.hits) + '\t' +
+                      std::to_string(nanos / 1000) + '\t' +
+                      std::to_string(expression.attempts != 0 ? nanos / expression.attempts : 0) + '\t' +
+                      expression.pattern + '\n';
+        }
+        return report;
+    }
+
+    // Replaces the rules of this parser and all its copies with those of a
+    // rule file written by saveRules(). Parses already running finish on
+    // the old rules, later ones see the new rules; throws
+    // std::runtime_error, leaving the rules alone, if the file is unusable.
+    // Loaded rules are compiled in full before they are swapped in, so a
+    // bad pattern fails here rather than in a parse.
+    void loadRules(const std::string& path)
+    {
+        auto rules = RuleFile::load(path);
+        rules->table.warmup();
+        rules_->publish(std::move(rules));
+    }
+
+    // Number of rules in each group of the rules in use.
+    std::vector<size_t> ruleCounts() const
+    {
+        const auto reader = rules_->read();
+        auto counts = std::vector<size_t>();
+        for (const auto& group : reader.rules().table.groups())
+        {
+            counts.push_back(group.ruleEnd - group.ruleBegin);
+        }
+        return counts;
+    }
+
+    // Lets a rule that matched skip the rules of later groups that
+    // getImplications() rules out for it. Results stay those of a full
+    // parse, since an implication is only listed once tools/uap_implications
+    // finds no UA it changes.
+    void enableImplications(const bool enabled = true)
+    {
+        implications_ = enabled;
+    }
+
+    // Detect by default.
+    void setBotHandling(const BotHandling handling)
+    {
+        botHandling_ = handling;
+    }
+
+    // Which rules of the group would match ua on their own, regardless of
+    // the rules before them.
+    std::vector<bool> matchingRules(StringView ua, const size_t groupIdx) const
+    {
+        if (limits_.maxLength != 0 && ua.size() > limits_.maxLength)
+        {
+            ua = ua.substr(0, limits_.maxLength);
+        }
+        const auto reader = rules_->read();
+        const auto& rules = reader.rules();
+        const auto candidates = rules.prefilter.scan(ua);
+        auto context = ParseContext();
+        const Subject subject(ua, context);
+        const auto& group = rules.table.groups().at(groupIdx);
+        auto budget = Budget(std::chrono::microseconds{0});
+        auto matching = std::vector<bool>();
+        for (auto ruleIdx = group.ruleBegin; ruleIdx < group.ruleEnd; ++ruleIdx)
+        {
+            matching.push_back(rules.table.matches(rules.table.rules()[ruleIdx], subject, candidates, budget));
+        }
+        return matching;
+    }
+
+    // Swaps in the rules in use with each group's rules evaluated in the
+    // given order, order[group] listing rule indices as ruleCounts() counts
+    // them. Since the first match wins, this only leaves results alone if
+    // no UA matches two rules that changed places; tools/uap_reorder checks
+    // that on a sample. Throws std::invalid_argument unless every group's
+    // order is a permutation.
+    void reorderRules(const std::vector<std::vector<size_t>>& order)
+    {
+        auto groups = std::vector<MatcherGroup>();
+        {
+            const auto reader = rules_->read();
+            groups = reader.rules().table.matcherGroups(order);
         }
+        rules_->publish(std::make_shared<const RuleSet>(groups));
+    }
+
+    // Writes the rules in use to a rule file.
+    void saveRules(const std::string& path) const
+    {
+        const auto reader = rules_->read();
+        RuleFile::save(reader.rules().table, path);
+    }
+
+    // Checksum of the rules in use, the bots and the formatters, the same
+    // for equal rules wherever they were loaded from. Results parsed with a
+    // different version may differ.
+    uint64_t rulesVersion() const
+    {
+        const auto reader = rules_->read();
+        return reader.rules().version;
+    }
+
+    // Only the fields in the mask are filled in, the others are left
+    // empty. They still come out exactly as a full parse would have them.
+    Result parse(const std::string& ua, const FieldMask fields = Fields::All) const
+    {
+        return parseView(ua, fields).toResult();
+    }
+
+    // Writes into result, reusing its strings; with a context that has
+    // been used before, the parse allocates nothing.
+    void parse(StringView ua, ParseContext& context, Result& result, const FieldMask fields = Fields::All) const
+    {
+        parseView(ua, context, fields).assignTo(result);
+    }
+
+    // Parses without copying the UA; see ResultView for the lifetime rules.
+    ResultView parseView(StringView ua, const FieldMask fields = Fields::All) const
+    {
+        static thread_local ParseContext context;
+        auto result = ResultView();
+        parseInto(ua, context, fields, result);
+        return result;
+    }
 
+    // Same, except that values formatters synthesize are kept in context,
+    // so the view is only valid until context parses the next UA.
+    ResultView parseView(StringView ua, ParseContext& context, const FieldMask fields = Fields::All) const
+    {
+        context.scratchUsed_ = 0;
+        auto result = ResultView();
+        result.context_ = &context;
+        parseInto(ua, context, fields, result);
         return result;
     }
 
+private:
+    struct Counters
+    {
+        std::atomic<uint64_t> truncated{0};
+        std::atomic<uint64_t> budgetExceeded{0};
+    };
+
+    // Time left for a single parse.
+    struct Budget
+    {
+    private:
+        using Clock = std::chrono::steady_clock;
+
+    private:
+        bool timed_;
+        Clock::time_point deadline_;
+        bool exceeded_;
+
+    public:
+        explicit Budget(const std::chrono::microseconds timeBudget)
+        : timed_(timeBudget.count() != 0)
+        , deadline_(timed_ ? Clock::now() + timeBudget : Clock::time_point())
+        , exceeded_(false)
+        {
+        }
+        // Checks the clock, so only call it before work worth timing.
+        bool expired()
+        {
+            if (!exceeded_ && timed_ && Clock::now() >= deadline_)
+            {
+                exceeded_ = true;
+            }
+            return exceeded_;
+        }
+        void exceed()
+        {
+            exceeded_ = true;
+        }
+        bool exceeded() const
+        {
+            return exceeded_;
+        }
+    };
+
+    struct RuleSet;
+    struct RuleSlot;
+    struct Subject;
+
+private:
+    Limits limits_;
+    std::shared_ptr<Counters> counters_;
+    std::shared_ptr<RuleSlot> rules_;
+    bool implications_ = false;
+    BotHandling botHandling_ = BotHandling::Detect;
+
+private:
+    void parseInto(StringView ua, ParseContext& context, const FieldMask fields, ResultView& result) const
+    {
+        if (limits_.maxLength != 0 && ua.size() > limits_.maxLength)
+        {
+            ua = ua.substr(0, limits_.maxLength);
+            result.truncated = true;
+            ++counters_->truncated;
+        }
+
+        auto budget = Budget(limits_.timeBudget);
+        const auto reader = rules_->read();
+        const auto& rules = reader.rules();
+        rules.prefilter.scan(ua, context.candidates_);
+        if (botHandling_ != BotHandling::Ignore &&
+            detectBot(context.candidates_, rules.table.expressions().size(), result) &&
+            botHandling_ == BotHandling::ShortCircuit)
+        {
+            return;
+        }
+        const Subject subject(ua, context);
+        auto* skipped = implications_ ? &context.skipped_ : nullptr;
+        if (skipped)
+        {
+            skipped->assign(rules.table.rules().size(), false);
+        }
+        for (size_t groupIdx = 0; groupIdx < rules.table.groups().size(); ++groupIdx)
+        {
+            if (!parseGroup(rules, subject, context.candidates_, groupIdx, fields, budget, result, skipped))
+            {
+                result.budgetExceeded = true;
+                ++counters_->budgetExceeded;
+                break;
+            }
+        }
+
+        // Once all groups ran, since later ones may overwrite a version.
+        result.browserVersionNumber = Version::parse(result.browserVersion);
+        result.engineVersionNumber = Version::parse(result.engineVersion);
+        result.osVersionNumber = Version::parse(result.osVersion);
+    }
+
+    // The prefilter scans for the tokens of getBots() along with the
+    // expressions' literals, its candidates from botsBegin on being the
+    // bots; the first entry with a token in the UA wins.
+    static bool detectBot(const std::vector<bool>& candidates, const size_t botsBegin, ResultView& result)
+    {
+        const auto begin = candidates.begin() + botsBegin;
+        const auto bot = std::find(begin, candidates.end(), true);
+        if (bot == candidates.end())
+        {
+            return false;
+        }
+        result.isBot = true;
+        result.botName = getBots()[bot - begin].name;
+        return true;
+    }
+
+    // First match wins, so a rule writing none of the requested fields
+    // still has to run if a later one could write some: it may be the one
+    // that matches. Only once no rule left in the group writes a requested
+    // field can the rest be skipped. Returns false, having written nothing,
+    // if the budget ran out. With skipped, rules it marks are passed over
+    // and the rule that matches marks those its implications rule out.
+    bool parseGroup(const RuleSet& ruleSet,
+                    const Subject& subject,
+                    const std::vector<bool>& candidates,
+                    const size_t groupIdx,
+                    const FieldMask fields,
+                    Budget& budget,
+                    ResultView& result,
+                    std::vector<bool>* skipped = nullptr) const
+    {
+        const auto& rules = ruleSet.table;
+        const auto& group = rules.groups()[groupIdx];
+        for (auto ruleIdx = group.ruleBegin; ruleIdx < group.ruleEnd; ++ruleIdx)
+        {
+            if (skipped && (*skipped)[ruleIdx])
+            {
+                continue;
+            }
+            const auto& rule = rules.rules()[ruleIdx];
+            if (!(rule.remainingFields & fields))
+            {
+                break;
+            }
+            if (rules.match(rule, subject, candidates, fields, budget, result))
+            {
+                if (skipped)
+                {
+                    for (const auto implied : ruleSet.implied[ruleIdx])
+                    {
+                        (*skipped)[implied] = true;
+                    }
+                }
+                break;
+            }
+            if (budget.exceeded())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
 private:
     struct Matcher;
+    struct LiteralAlternation;
+    struct RuleTable;
+    struct LiteralPrefilter;
+    struct RuleFile;
+    struct Implication;
+    struct Bot;
     using MatcherGroup = std::vector<Matcher>;
 
-    const std::vector<MatcherGroup>& getMatcherGroups() const
+    // The rules as written down; parsing goes through builtinRules() or
+    // the rules loaded in their place.
+    static std::vector<MatcherGroup> getMatcherGroups()
     {
-        using RegexImpl::regex;
+        using regex = Source; // compiled on first use, see RuleTable
 
         static const auto CONSOLE = "console";
         // TODO: static const auto DESKTOP = "desktop";
@@ -64,8 +750,8 @@ private:
         static const auto SMARTTV = "smarttv";
         static const auto TABLET = "tablet";
         static const auto WEARABLE = "wearable";
-        static const auto i = regex::ECMAScript | regex::icase;
-        static const auto regexes = std::vector<MatcherGroup>{
+        static const auto i = RegexImpl::regex::ECMAScript | RegexImpl::regex::icase;
+        const auto regexes = std::vector<MatcherGroup>{
             {
                 // browser
                 {{
@@ -777,190 +1463,2781 @@ private:
         return regexes;
     }
 
+    // What a match in one group says about a later one: once the rule
+    // named by when matched, that group can only end up at one of the
+    // rules named in then, or at none of its rules, so all others are
+    // skipped. Rules are named by their first expression. An entry only
+    // belongs here once tools/uap_implications finds no UA it changes,
+    // crafted ones included. None has passed yet: every expression has
+    // literals the prefilter checks, so a rule an entry skips has its
+    // literals in the UA and may well match (x86 ruling out devices lost
+    // Android x86 tablets, Chrome for iOS ruling out all but iOS lost the
+    // Mac OS fallback).
+    static std::vector<Implication> getImplications()
+    {
+        static const std::vector<Implication> implications = {};
+        return implications;
+    }
+
+    // Automated agents, named ones first. Crawlers and probes mostly spell
+    // out what they are, so a few literals cover the bulk of them without
+    // running a single expression.
+    static const std::vector<Bot>& getBots()
+    {
+        static const std::vector<Bot> bots = {
+            {"Googlebot", {"googlebot", "adsbot-google", "mediapartners-google", "google-inspectiontool"}},
+            {"bingbot", {"bingbot", "bingpreview", "msnbot"}},
+            {"YandexBot", {"yandexbot", "yandex.com/bots"}},
+            {"Baiduspider", {"baiduspider"}},
+            {"DuckDuckBot", {"duckduckbot"}},
+            {"Yahoo! Slurp", {"yahoo! slurp"}},
+            {"Applebot", {"applebot"}},
+            {"facebookexternalhit", {"facebookexternalhit", "facebookcatalog"}},
+            {"Twitterbot", {"twitterbot"}},
+            {"LinkedInBot", {"linkedinbot"}},
+            {"Slackbot", {"slackbot"}},
+            {"AhrefsBot", {"ahrefsbot"}},
+            {"SemrushBot", {"semrushbot"}},
+            {"MJ12bot", {"mj12bot"}},
+            {"PetalBot", {"petalbot"}},
+            {"GPTBot", {"gptbot"}},
+            {"UptimeRobot", {"uptimerobot"}},
+            {"Pingdom", {"pingdom"}},
+            {"Datadog", {"datadog"}},
+            {"kube-probe", {"kube-probe/"}},
+            {"HeadlessChrome", {"headlesschrome"}},
+            {"PhantomJS", {"phantomjs"}},
+            {"curl", {"curl/"}},
+            {"Wget", {"wget/"}},
+            {"python-requests", {"python-requests/"}},
+            {"Python-urllib", {"python-urllib/"}},
+            {"Go-http-client", {"go-http-client/"}},
+            {"Apache-HttpClient", {"apache-httpclient/"}},
+            {"Java", {"java/"}},
+            {"", {"crawler", "spider", "bot/", "bot;", "bot)", "+http"}},
+        };
+        return bots;
+    }
+
+    static std::vector<std::vector<std::string>> getBotTokens()
+    {
+        auto tokens = std::vector<std::vector<std::string>>();
+        for (const auto& bot : getBots())
+        {
+            tokens.push_back(bot.tokens);
+        }
+        return tokens;
+    }
+
+    static std::shared_ptr<const RuleSet> builtinRules()
+    {
+        static const auto rules = std::make_shared<const RuleSet>(getMatcherGroups(), RuleSet::Source::Builtin);
+        return rules;
+    }
+
 private:
     struct FnReplace
     {
         const char old_;
         const char new_;
-        std::string operator()(std::string&& s)
+        StringView operator()(StringView s, ResultView& result)
         {
-            std::replace(s.begin(), s.end(), old_, new_);
-            return s;
+            if (s.find(old_) == StringView::npos)
+            {
+                return s;
+            }
+            auto& v = result.store(s);
+            std::replace(v.begin(), v.end(), old_, new_);
+            return v;
         }
     };
 
     struct FnToLower
     {
-        std::string operator()(std::string&& s)
+        StringView operator()(StringView s, ResultView& result)
         {
-            std::transform(s.begin(), s.end(), s.begin(), ::tolower);
-            return s;
+            if (std::none_of(s.begin(), s.end(), ::isupper))
+            {
+                return s;
+            }
+            auto& v = result.store(s);
+            std::transform(v.begin(), v.end(), v.begin(), ::tolower);
+            return v;
         }
     };
 
-    struct FnFixSafariVersion
+    // Entry of the formatters' lookup tables. They are plain sorted arrays of
+    // literals, so they need no initialization at runtime and are searched
+    // without building a key.
+    struct Mapping
     {
-        std::string operator()(std::string&& s)
+        const char* key;
+        size_t keySize;
+        const char* value;
+        size_t valueSize;
+
+        template <size_t K, size_t V>
+        constexpr Mapping(const char (&k)[K], const char (&v)[V])
+        : key(k)
+        , keySize(K - 1)
+        , value(v)
+        , valueSize(V - 1)
         {
-            static const auto mapping =
-                std::unordered_map<std::string, std::string>{
-                    {"/8", "1.0"},
-                    {"/1", "1.2"},
-                    {"/3", "1.3"},
-                    {"/412", "2.0"},
-                    {"/416", "2.0.2"},
-                    {"/417", "2.0.3"},
-                    {"/419", "2.0.4"},
-                    {"/", "?"},
-                };
-            const auto it = mapping.find(s);
-            return it != mapping.end() ? it->second : s;
         }
     };
 
-    struct FnFixAmazonDeviceModel
+    // Byte-wise, like StringView's own comparison.
+    static constexpr int compareKeys(const Mapping& lhs, const Mapping& rhs)
     {
-        std::string operator()(std::string&& s)
+        for (size_t idx = 0; idx < lhs.keySize && idx < rhs.keySize; ++idx)
         {
-            static const auto mapping =
-                std::unordered_map<std::string, std::string>{
-                    {"KF", "Fire Phone"},
-                    {"SD", "Fire Phone"},
-                };
-            const auto it = mapping.find(s);
-            return it != mapping.end() ? it->second : s;
+            if (lhs.key[idx] != rhs.key[idx])
+            {
+                return static_cast<unsigned char>(lhs.key[idx]) - static_cast<unsigned char>(rhs.key[idx]);
+            }
         }
-    };
+        return lhs.keySize < rhs.keySize ? -1 : lhs.keySize > rhs.keySize ? 1 : 0;
+    }
 
-    struct FnFixWindowsVersion
+    template <size_t N>
+    static constexpr bool isSorted(const Mapping (&mapping)[N])
     {
-        std::string operator()(std::string&& s)
-        {
-            static const auto mapping =
-                std::unordered_map<std::string, std::string>{
-                    {"4.90", "ME"},
-                    {"NT3.51", "NT 3.11"},
-                    {"NT4.0", "NT 4.0"},
-                    {"NT 5.0", "2000"},
-                    {"NT 5.1", "XP"},
-                    {"NT 5.2", "XP"},
-                    {"NT 6.0", "Vista"},
-                    {"NT 6.1", "7"},
-                    {"NT 6.2", "8"},
-                    {"NT 6.3", "8.1"},
-                    {"NT 6.4", "10"},
-                    {"NT 10.0", "10"},
-                    {"ARM", "RT"},
-                };
-            const auto it = mapping.find(s);
-            return it != mapping.end() ? it->second : s;
+        for (size_t idx = 1; idx < N; ++idx)
+        {
+            if (compareKeys(mapping[idx - 1], mapping[idx]) >= 0)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // The value s maps to, or s itself if it is not a key.
+    template <size_t N>
+    static StringView lookup(const Mapping (&mapping)[N], StringView s)
+    {
+        const auto it = std::lower_bound(std::begin(mapping), std::end(mapping), s,
+                                         [](const Mapping& entry, StringView key) {
+                                             return StringView(entry.key, entry.keySize) < key;
+                                         });
+        if (it == std::end(mapping) || StringView(it->key, it->keySize) != s)
+        {
+            return s;
+        }
+        return StringView(it->value, it->valueSize);
+    }
+
+    struct FnFixSafariVersion
+    {
+        static const auto& mapping()
+        {
+            static constexpr Mapping mapping[] = {
+                {"/", "?"},
+                {"/1", "1.2"},
+                {"/3", "1.3"},
+                {"/412", "2.0"},
+                {"/416", "2.0.2"},
+                {"/417", "2.0.3"},
+                {"/419", "2.0.4"},
+                {"/8", "1.0"},
+            };
+            static_assert(isSorted(mapping), "keys must be sorted");
+            return mapping;
+        }
+
+        StringView operator()(StringView s, ResultView& result)
+        {
+            return lookup(mapping(), s);
+        }
+    };
+
+    struct FnFixAmazonDeviceModel
+    {
+        static const auto& mapping()
+        {
+            static constexpr Mapping mapping[] = {
+                {"KF", "Fire Phone"},
+                {"SD", "Fire Phone"},
+            };
+            static_assert(isSorted(mapping), "keys must be sorted");
+            return mapping;
+        }
+
+        StringView operator()(StringView s, ResultView& result)
+        {
+            return lookup(mapping(), s);
+        }
+    };
+
+    struct FnFixWindowsVersion
+    {
+        static const auto& mapping()
+        {
+            static constexpr Mapping mapping[] = {
+                {"4.90", "ME"},
+                {"ARM", "RT"},
+                {"NT 10.0", "10"},
+                {"NT 5.0", "2000"},
+                {"NT 5.1", "XP"},
+                {"NT 5.2", "XP"},
+                {"NT 6.0", "Vista"},
+                {"NT 6.1", "7"},
+                {"NT 6.2", "8"},
+                {"NT 6.3", "8.1"},
+                {"NT 6.4", "10"},
+                {"NT3.51", "NT 3.11"},
+                {"NT4.0", "NT 4.0"},
+            };
+            static_assert(isSorted(mapping), "keys must be sorted");
+            return mapping;
+        }
+
+        StringView operator()(StringView s, ResultView& result)
+        {
+            return lookup(mapping(), s);
         }
     };
 
     struct FnFixSprintDeviceModel
     {
-        std::string operator()(std::string&& s)
+        static const auto& mapping()
+        {
+            static constexpr Mapping mapping[] = {
+                {"7373KT", "Evo Shift 4G"},
+            };
+            return mapping;
+        }
+
+        StringView operator()(StringView s, ResultView& result)
         {
-            static const auto mapping =
-                std::unordered_map<std::string, std::string>{
-                    {"7373KT", "Evo Shift 4G"},
-                };
-            const auto it = mapping.find(s);
-            return it != mapping.end() ? it->second : s;
+            return lookup(mapping(), s);
         }
     };
 
     struct FnFixSprintDeviceVendor
     {
-        std::string operator()(std::string&& s)
+        static const auto& mapping()
         {
-            static const auto mapping =
-                std::unordered_map<std::string, std::string>{
-                    {"APA", "HTC"},
-                };
-            const auto it = mapping.find(s);
-            return it != mapping.end() ? it->second : s;
+            static constexpr Mapping mapping[] = {
+                {"APA", "HTC"},
+            };
+            return mapping;
+        }
+
+        StringView operator()(StringView s, ResultView& result)
+        {
+            return lookup(mapping(), s);
         }
     };
 
 private:
+    // Capture groups of a successful match, however it was found; groups
+    // that did not participate are empty. Eight groups are plenty for every
+    // expression in getMatcherGroups().
+    struct Captures
+    {
+        enum : size_t
+        {
+            MAX_GROUPS = 8,
+        };
+
+        size_t size;
+        StringView groups[MAX_GROUPS];
+    };
+
+    // Where the bytes that give a UA its structure are: whitespace between
+    // product tokens, '/' between a product's name and version, and the
+    // parentheses and semicolons around and between comment tokens. One
+    // bitmap per delimiter, bit n standing for byte n, filled in a single
+    // pass over the UA that looks at 32 or 16 bytes at a time on x86-64,
+    // with AVX2 where the CPU has it and SSE2 otherwise.
+    struct Delimiters
+    {
+    public:
+        enum : size_t
+        {
+            WHITESPACE, // "\t\n\v\f\r ", what \s matches in the C locale
+            OPEN,
+            CLOSE,
+            SLASH,
+            SEMICOLON,
+            COUNT,
+        };
+
+    private:
+        const uint64_t* bitmaps_;
+        size_t words_;
+
+    public:
+        // Bitmaps are kept in buffer, so only until the next scan into it.
+        Delimiters(StringView text, std::vector<uint64_t>& buffer)
+        : bitmaps_()
+        , words_((text.size() + 63) / 64)
+        {
+            buffer.assign(COUNT * words_, 0);
+            static const auto scan = pickScan();
+            scan(text.data(), text.size(), buffer.data(), words_);
+            bitmaps_ = buffer.data();
+        }
+
+        static bool contains(const size_t delimiter, const unsigned char ch)
+        {
+            switch (delimiter)
+            {
+            case WHITESPACE:
+                return ch == ' ' || (ch >= '\t' && ch <= '\r');
+            case OPEN:
+                return ch == '(';
+            case CLOSE:
+                return ch == ')';
+            case SLASH:
+                return ch == '/';
+            case SEMICOLON:
+                return ch == ';';
+            default:
+                return false;
+            }
+        }
+
+        size_t words() const
+        {
+            return words_;
+        }
+
+        // Bits 64 * word + shift up to 64 * word + shift + 63 of the
+        // delimiter's bitmap, so a set bit n means the delimiter is n + shift
+        // bytes past the word's first byte.
+        uint64_t window(const size_t delimiter, const size_t word, const size_t shift) const
+        {
+            const auto* bitmap = bitmaps_ + delimiter * words_;
+            const auto idx = word + shift / 64;
+            const auto bit = shift % 64;
+            const auto low = idx < words_ ? bitmap[idx] >> bit : 0;
+            const auto high = bit != 0 && idx + 1 < words_ ? bitmap[idx + 1] << (64 - bit) : 0;
+            return low | high;
+        }
+
+    private:
+        using Scan = void (*)(const char*, size_t, uint64_t*, size_t);
+
+        static Scan pickScan()
+        {
+#ifdef __x86_64__
+            return __builtin_cpu_supports("avx2") ? &scanAvx2 : &scanSse2;
+#else
+            return &scanScalar;
+#endif
+        }
+
+        static void scanScalar(const char* data, const size_t size, uint64_t* bitmaps, const size_t words)
+        {
+            scanTail(data, 0, size, bitmaps, words);
+        }
+
+        static void scanTail(const char* data, size_t pos, const size_t size, uint64_t* bitmaps, const size_t words)
+        {
+            for (; pos < size; ++pos)
+            {
+                for (size_t delimiter = 0; delimiter < COUNT; ++delimiter)
+                {
+                    if (contains(delimiter, static_cast<unsigned char>(data[pos])))
+                    {
+                        bitmaps[delimiter * words + pos / 64] |= uint64_t{1} << (pos % 64);
+                    }
+                }
+            }
+        }
+
+#ifdef __x86_64__
+        // Whitespace is a space or, once '\t' is subtracted, at most 4.
+        static void scanSse2(const char* data, const size_t size, uint64_t* bitmaps, const size_t words)
+        {
+            const __m128i bytes[] = {_mm_set1_epi8('('), _mm_set1_epi8(')'), _mm_set1_epi8('/'), _mm_set1_epi8(';')};
+            const auto space = _mm_set1_epi8(' ');
+            const auto tab = _mm_set1_epi8('\t');
+            const auto controls = _mm_set1_epi8('\r' - '\t');
+            auto pos = size_t{0};
+            for (; pos + 16 <= size; pos += 16)
+            {
+                const auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+                const auto control = _mm_sub_epi8(chunk, tab);
+                const auto whitespace = _mm_or_si128(_mm_cmpeq_epi8(chunk, space),
+                                                     _mm_cmpeq_epi8(_mm_min_epu8(control, controls), control));
+                auto* word = bitmaps + pos / 64;
+                const auto shift = pos % 64;
+                word[WHITESPACE * words] |= uint64_t{static_cast<uint32_t>(_mm_movemask_epi8(whitespace))} << shift;
+                for (size_t delimiter = OPEN; delimiter < COUNT; ++delimiter)
+                {
+                    const auto matches = _mm_cmpeq_epi8(chunk, bytes[delimiter - OPEN]);
+                    word[delimiter * words] |= uint64_t{static_cast<uint32_t>(_mm_movemask_epi8(matches))} << shift;
+                }
+            }
+            scanTail(data, pos, size, bitmaps, words);
+        }
+
+        __attribute__((target("avx2"))) static void scanAvx2(const char* data,
+                                                             const size_t size,
+                                                             uint64_t* bitmaps,
+                                                             const size_t words)
+        {
+            const __m256i bytes[] = {
+                _mm256_set1_epi8('('), _mm256_set1_epi8(')'), _mm256_set1_epi8('/'), _mm256_set1_epi8(';')};
+            const auto space = _mm256_set1_epi8(' ');
+            const auto tab = _mm256_set1_epi8('\t');
+            const auto controls = _mm256_set1_epi8('\r' - '\t');
+            auto pos = size_t{0};
+            for (; pos + 32 <= size; pos += 32)
+            {
+                const auto chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+                const auto control = _mm256_sub_epi8(chunk, tab);
+                const auto whitespace = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, space),
+                                                        _mm256_cmpeq_epi8(_mm256_min_epu8(control, controls), control));
+                auto* word = bitmaps + pos / 64;
+                const auto shift = pos % 64;
+                word[WHITESPACE * words] |= uint64_t{static_cast<uint32_t>(_mm256_movemask_epi8(whitespace))} << shift;
+                for (size_t delimiter = OPEN; delimiter < COUNT; ++delimiter)
+                {
+                    const auto matches = _mm256_cmpeq_epi8(chunk, bytes[delimiter - OPEN]);
+                    word[delimiter * words] |= uint64_t{static_cast<uint32_t>(_mm256_movemask_epi8(matches))} << shift;
+                }
+            }
+            scanTail(data, pos, size, bitmaps, words);
+        }
+#endif
+    };
+
+    // The UA as the expressions see it: as given, and lowercased once for
+    // all the case-insensitive expressions, which RuleTable compiles to
+    // match it case-sensitively. Both have the same length, so a capture
+    // in one is the same range in the other. ASCII only, like boost's case
+    // folding in the C locale. The lowercased copy, the delimiters and the
+    // match results live in the context until it makes the next Subject.
+    struct Subject
+    {
+    public:
+        StringView ua;
+        StringView folded;
+        Delimiters delimiters;
+        RegexImpl::cmatch& matches;
+
+    public:
+        Subject(StringView text, ParseContext& context)
+        : ua(text)
+        , folded()
+        , delimiters(text, context.delimiters_)
+        , matches(context.matches_)
+        {
+            auto& buffer = context.folded_;
+            buffer.resize(text.size());
+            auto* out = &buffer[0];
+            for (size_t pos = 0; pos < text.size(); ++pos)
+            {
+                const auto ch = text[pos];
+                out[pos] = ch >= 'A' && ch <= 'Z' ? static_cast<char>(ch - 'A' + 'a') : ch;
+            }
+            folded = StringView(out, text.size());
+        }
+
+        // The same range of ua as view, a range of folded.
+        StringView original(StringView view) const
+        {
+            return view.data() ? StringView(ua.data() + (view.data() - folded.data()), view.size()) : view;
+        }
+    };
+
+    // Regex engines the rule table can run on. The rules are written as
+    // boost::regex, which also stays the fallback for every expression the
+    // selected backend cannot compile; build with -DUAP_REGEX_RE2 to run
+    // the rest on RE2.
+    struct BoostBackend
+    {
+        using Pattern = RegexImpl::regex;
+
+        static boost::optional<Pattern> compile(const RegexImpl::regex& expression)
+        {
+            return expression;
+        }
+
+        // matches is only scratch space, reused so its sub-match vector is
+        // allocated once.
+        static bool search(const Pattern& pattern, StringView ua, RegexImpl::cmatch& matches, Captures& captures)
+        {
+            if (!RegexImpl::regex_search(ua.begin(), ua.end(), matches, pattern))
+            {
+                return false;
+            }
+            captures.size = std::min<size_t>(matches.size(), Captures::MAX_GROUPS);
+            for (size_t group = 0; group < captures.size; ++group)
+            {
+                const auto& match = matches[group];
+                captures.groups[group] = match.matched ? StringView(match.first, match.length()) : StringView();
+            }
+            return true;
+        }
+    };
+
+#ifdef UAP_REGEX_RE2
+    // Linear-time and thread-safe. Lookarounds and back references have no
+    // RE2 equivalent, so expressions using them stay on boost.
+    struct Re2Backend
+    {
+        using Pattern = std::shared_ptr<const re2::RE2>;
+
+        static boost::optional<Pattern> compile(const RegexImpl::regex& expression)
+        {
+            // Latin-1 makes RE2 see bytes the way boost does, and '.' has
+            // to match newlines as it does in boost.
+            auto options = re2::RE2::Options();
+            options.set_encoding(re2::RE2::Options::EncodingLatin1);
+            const auto icase = (expression.flags() & RegexImpl::regex::icase) != 0;
+            options.set_case_sensitive(!icase);
+            options.set_dot_nl(true);
+            options.set_log_errors(false);
+            auto pattern = std::make_shared<const re2::RE2>(translate(expression.str(), icase), options);
+            if (!pattern->ok() || pattern->NumberOfCapturingGroups() != static_cast<int>(expression.mark_count()))
+            {
+                return boost::none;
+            }
+            return Pattern(std::move(pattern));
+        }
+
+        // RE2 needs no scratch space beyond groups, so matches goes unused.
+        static bool search(const Pattern& pattern, StringView ua, RegexImpl::cmatch& matches, Captures& captures)
+        {
+            re2::StringPiece groups[Captures::MAX_GROUPS];
+            const auto size = std::min<size_t>(pattern->NumberOfCapturingGroups() + 1, Captures::MAX_GROUPS);
+            if (!pattern->Match(re2::StringPiece(ua.data(), ua.size()), 0, ua.size(), re2::RE2::UNANCHORED,
+                                groups, static_cast<int>(size)))
+            {
+                return false;
+            }
+            captures.size = size;
+            for (size_t group = 0; group < size; ++group)
+            {
+                captures.groups[group] = StringView(groups[group].data(), groups[group].size());
+            }
+            return true;
+        }
+
+    private:
+        // ECMAScript's \s includes the vertical tab, RE2's does not. Ignoring
+        // case, boost lowercases a range's ends along with the input, so
+        // [A-z] is [a-z] to it where RE2 would take in [\]^_` as well.
+        static std::string translate(const std::string& pattern, const bool icase)
+        {
+            const auto lower = [](const char ch) {
+                return ch >= 'A' && ch <= 'Z' ? static_cast<char>(ch - 'A' + 'a') : ch;
+            };
+            auto result = std::string();
+            auto inClass = false;
+            for (size_t pos = 0; pos < pattern.size(); ++pos)
+            {
+                const auto ch = pattern[pos];
+                if (ch == '\\' && pos + 1 < pattern.size())
+                {
+                    const auto escaped = pattern[++pos];
+                    if (escaped == 's')
+                    {
+                        result += inClass ? "\\s\\v" : "[\\s\\v]";
+                    }
+                    else
+                    {
+                        result += ch;
+                        result += escaped;
+                    }
+                    continue;
+                }
+                if (ch == '[' && !inClass)
+                {
+                    inClass = true;
+                }
+                else if (ch == ']' && inClass)
+                {
+                    inClass = false;
+                }
+                else if (icase && inClass && pos + 2 < pattern.size() && pattern[pos + 1] == '-' &&
+                         pattern[pos + 2] != ']' && pattern[pos + 2] != '\\')
+                {
+                    result += lower(ch);
+                    result += '-';
+                    result += lower(pattern[pos + 2]);
+                    pos += 2;
+                    continue;
+                }
+                result += ch;
+            }
+            return result;
+        }
+    };
+
+    using RegexBackend = Re2Backend;
+#else
+    using RegexBackend = BoostBackend;
+#endif
+
+    // Where a field's value comes from: a capture group, possibly run
+    // through one of the Fn* formatters, or a constant. Plain data, so the
+    // rule table can keep extractors in one array and dispatch formatters
+    // with a switch rather than through std::function.
     struct Extractor
     {
     private:
-        using Formatter = std::function<std::string(std::string&&)>;
+        friend struct RuleFile;
+
+        static const size_t FIELD_COUNT = 11;
+
+        // Stored in rule files, so only ever append.
+        enum class Format : uint8_t
+        {
+            None,
+            Value,
+            Replace,
+            ToLower,
+            FixSafariVersion,
+            FixAmazonDeviceModel,
+            FixWindowsVersion,
+            FixSprintDeviceModel,
+            FixSprintDeviceVendor,
+            Count,
+        };
 
     private:
-        std::string Result::*f_;
-        boost::optional<std::string> v_;
-        Formatter fn_;
+        size_t field_;
+        StringView ResultView::*f_;
+        Format format_;
+        char old_;
+        char new_;
+        StringView v_;
 
     public:
         Extractor(std::string Result::*f)
-        : f_(f)
-        , v_()
-        , fn_()
+        : Extractor(f, Format::None)
         {
         }
-        Extractor(std::string Result::*f, std::string v)
-        : f_(f)
-        , v_(v)
-        , fn_()
+        Extractor(std::string Result::*f, const char* v)
+        : Extractor(f, Format::Value)
         {
+            v_ = v;
         }
-        Extractor(std::string Result::*f, Formatter fn)
-        : f_(f)
-        , v_()
-        , fn_(std::move(fn))
+        Extractor(std::string Result::*f, FnReplace fn)
+        : Extractor(f, Format::Replace)
+        {
+            old_ = fn.old_;
+            new_ = fn.new_;
+        }
+        Extractor(std::string Result::*f, FnToLower)
+        : Extractor(f, Format::ToLower)
+        {
+        }
+        Extractor(std::string Result::*f, FnFixSafariVersion)
+        : Extractor(f, Format::FixSafariVersion)
+        {
+        }
+        Extractor(std::string Result::*f, FnFixAmazonDeviceModel)
+        : Extractor(f, Format::FixAmazonDeviceModel)
+        {
+        }
+        Extractor(std::string Result::*f, FnFixWindowsVersion)
+        : Extractor(f, Format::FixWindowsVersion)
+        {
+        }
+        Extractor(std::string Result::*f, FnFixSprintDeviceModel)
+        : Extractor(f, Format::FixSprintDeviceModel)
+        {
+        }
+        Extractor(std::string Result::*f, FnFixSprintDeviceVendor)
+        : Extractor(f, Format::FixSprintDeviceVendor)
+        {
+        }
+        FieldMask field() const
         {
+            return FieldMask{1} << field_;
         }
-        void operator()(const std::string& ua,
-                        const RegexImpl::smatch& matches,
+        void operator()(StringView ua,
+                        const Captures& captures,
                         const size_t group,
-                        Result& result) const
+                        ResultView& result) const
         {
-            if (v_)
+            if (format_ == Format::Value)
             {
-                result.*f_ = *v_;
+                result.*f_ = v_;
                 return;
             }
-            if (f_ && matches.size() >= group)
+            if (captures.size >= group)
             {
-                auto v = matches[group].str();
-                result.*f_ = fn_ ? fn_(std::move(v)) : std::move(v);
+                const auto v = group < captures.size ? captures.groups[group] : StringView();
+                result.*f_ = format(v, result);
             }
         }
+
+    private:
+        Extractor(std::string Result::*f, const Format format)
+        : field_(fieldIdx(f))
+        , f_(toView(field_))
+        , format_(format)
+        , old_()
+        , new_()
+        , v_()
+        {
+        }
+
+        Extractor(const size_t field, const Format format, const char oldChar, const char newChar, StringView v)
+        : field_(field)
+        , f_(toView(field_))
+        , format_(format)
+        , old_(oldChar)
+        , new_(newChar)
+        , v_(v)
+        {
+        }
+
+        StringView format(StringView v, ResultView& result) const
+        {
+            switch (format_)
+            {
+            case Format::Replace:
+                return FnReplace{old_, new_}(v, result);
+            case Format::ToLower:
+                return FnToLower{}(v, result);
+            case Format::FixSafariVersion:
+                return FnFixSafariVersion{}(v, result);
+            case Format::FixAmazonDeviceModel:
+                return FnFixAmazonDeviceModel{}(v, result);
+            case Format::FixWindowsVersion:
+                return FnFixWindowsVersion{}(v, result);
+            case Format::FixSprintDeviceModel:
+                return FnFixSprintDeviceModel{}(v, result);
+            case Format::FixSprintDeviceVendor:
+                return FnFixSprintDeviceVendor{}(v, result);
+            default:
+                return v;
+            }
+        }
+
+        // Position of f in Result, which is also its bit in Fields.
+        static size_t fieldIdx(std::string Result::*f)
+        {
+            static std::string Result::*const fields[] = {
+                &Result::browserName,
+                &Result::browserUnit,
+                &Result::browserVersion,
+                &Result::cpuArchitecture,
+                &Result::deviceType,
+                &Result::deviceModel,
+                &Result::deviceVendor,
+                &Result::engineName,
+                &Result::engineVersion,
+                &Result::osName,
+                &Result::osVersion,
+            };
+            return std::find(std::begin(fields), std::end(fields), f) - std::begin(fields);
+        }
+
+        static StringView ResultView::*toView(const size_t field)
+        {
+            static StringView ResultView::*const views[] = {
+                &ResultView::browserName,
+                &ResultView::browserUnit,
+                &ResultView::browserVersion,
+                &ResultView::cpuArchitecture,
+                &ResultView::deviceType,
+                &ResultView::deviceModel,
+                &ResultView::deviceVendor,
+                &ResultView::engineName,
+                &ResultView::engineVersion,
+                &ResultView::osName,
+                &ResultView::osVersion,
+            };
+            return views[field];
+        }
     };
 
-    struct Matcher
+    // Exact stand-in for regex_search() on the brand expressions that are
+    // little more than a literal alternation followed by a version, such as
+    // "(chromium|flock|...|iridium)\/([\w\.-]+)". Instead of letting the
+    // backtracking engine try every alternative at every position, only
+    // positions whose byte can start a match are tried and the version is a
+    // single greedy run. Each single-character atom is turned into a byte
+    // set by asking the regex engine itself, so escapes and case folding
+    // behave exactly as they do in boost.
+    struct LiteralAlternation
     {
     private:
-        std::vector<RegexImpl::regex> expressions_;
-        std::vector<Extractor> extractors_;
+        using ByteSet = std::bitset<256>;
+
+        // A single-character atom, possibly made optional by '?'.
+        struct Atom
+        {
+            ByteSet bytes;
+            bool optional;
+        };
+        using Atoms = std::vector<Atom>;
+
+        // prefix, alternative and separator atoms of one alternative in a
+        // row, with the bounds of the alternative itself.
+        struct Branch
+        {
+            Atoms atoms;
+            size_t captureBegin;
+            size_t captureEnd;
+        };
+
+        // A branch can only match where the delimiter is offset bytes past
+        // the start.
+        struct Anchor
+        {
+            size_t delimiter;
+            size_t offset;
+
+            bool operator==(const Anchor& other) const
+            {
+                return delimiter == other.delimiter && offset == other.offset;
+            }
+        };
+
+    private:
+        std::vector<Branch> branches_;
+        ByteSet version_;
+        bool hasVersion_;
+        bool versionOptional_;
+        ByteSet first_;
+        std::vector<Anchor> anchors_; // one per branch at most, or none to try every start
 
     public:
-        Matcher(std::vector<RegexImpl::regex> expressions,
-                std::vector<Extractor> extractors)
-        : expressions_(std::move(expressions))
-        , extractors_(std::move(extractors))
+        // Returns none unless expression has the shape
+        //   prefix(alternative|...)separator(version+)
+        // where prefix, alternatives and separator are runs of
+        // single-character atoms, each either plain, optional ('?', "{0,1}")
+        // or repeated a fixed number of times ("{n}"), and version is a
+        // single atom repeated with '+' or '*'. The version may be left out.
+        static boost::optional<LiteralAlternation> compile(const RegexImpl::regex& expression)
         {
+            const auto pattern = expression.str();
+            const auto end = pattern.size();
+            auto matcher = LiteralAlternation();
+
+            auto prefix = Atoms();
+            const auto groupBegin = findGroup(pattern, 0, end);
+            if (groupBegin == end || !parseAtoms(expression, 0, groupBegin, prefix))
+            {
+                return boost::none;
+            }
+            const auto groupEnd = LiteralPrefilter::skipAtom(pattern, groupBegin, end);
+            const auto versionBegin = findGroup(pattern, groupEnd, end);
+            auto separator = Atoms();
+            if (!isCapture(pattern, groupBegin, groupEnd) ||
+                !parseAtoms(expression, groupEnd, versionBegin, separator))
+            {
+                return boost::none;
+            }
+
+            auto alternativeBegin = groupBegin + 1;
+            for (auto pos = alternativeBegin; pos < groupEnd; pos = LiteralPrefilter::skipAtom(pattern, pos, groupEnd))
+            {
+                if (pos != groupEnd - 1 && pattern[pos] != '|')
+                {
+                    continue;
+                }
+                auto branch = Branch{prefix, prefix.size(), 0};
+                if (pos == alternativeBegin ||
+                    !parseAtoms(expression, alternativeBegin, pos, branch.atoms))
+                {
+                    return boost::none;
+                }
+                branch.captureEnd = branch.atoms.size();
+                branch.atoms.insert(branch.atoms.end(), separator.begin(), separator.end());
+                matcher.branches_.push_back(std::move(branch));
+                alternativeBegin = pos + 1;
+            }
+
+            matcher.hasVersion_ = versionBegin < end;
+            matcher.versionOptional_ = false;
+            if (matcher.hasVersion_)
+            {
+                // "(v+)*" captures the same longest run as "(v*)" does, or
+                // nothing at all where "(v*)" captures an empty string.
+                const auto versionEnd = LiteralPrefilter::skipAtom(pattern, versionBegin, end);
+                const auto repeated = versionEnd + 1 == end && pattern[versionEnd] == '*';
+                const auto next = LiteralPrefilter::skipAtom(pattern, versionBegin + 1, versionEnd - 1);
+                if (!isCapture(pattern, versionBegin, versionEnd) || (versionEnd != end && !repeated) ||
+                    !atomBytes(expression, versionBegin + 1, next, matcher.version_) ||
+                    next + 2 != versionEnd || (pattern[next] != '+' && pattern[next] != '*') ||
+                    (repeated && pattern[next] != '+'))
+                {
+                    return boost::none;
+                }
+                matcher.versionOptional_ = pattern[next] == '*' || repeated;
+            }
+            if (expression.mark_count() != (matcher.hasVersion_ ? 2u : 1u))
+            {
+                return boost::none;
+            }
+
+            // Bytes a match can start with; branches made of optional atoms
+            // only could match the empty string and are left to boost.
+            for (const auto& branch : matcher.branches_)
+            {
+                auto idx = size_t{0};
+                for (; idx < branch.atoms.size(); ++idx)
+                {
+                    matcher.first_ |= branch.atoms[idx].bytes;
+                    if (!branch.atoms[idx].optional)
+                    {
+                        break;
+                    }
+                }
+                if (idx == branch.atoms.size())
+                {
+                    return boost::none;
+                }
+            }
+            matcher.anchors_ = anchors(matcher.branches_);
+            return matcher;
         }
-        bool operator()(const std::string& ua, Result& result) const
+
+        // ua has to be the text delimiters were scanned from. Where every
+        // branch is anchored, only the starts some anchor allows are tried,
+        // in the same order as otherwise.
+        bool operator()(StringView ua, const Delimiters& delimiters, Captures& captures) const
         {
-            RegexImpl::smatch matches;
-            for (const auto& expression : expressions_)
+            if (anchors_.empty())
             {
-                if (!RegexImpl::regex_search(ua, matches, expression))
+                for (size_t start = 0; start < ua.size(); ++start)
                 {
-                    continue;
+                    if (matchAt(ua, start, captures))
+                    {
+                        return true;
+                    }
                 }
-                for (size_t idx = 0; idx < extractors_.size(); ++idx)
+                return false;
+            }
+            for (size_t word = 0; word < delimiters.words(); ++word)
+            {
+                auto starts = uint64_t{0};
+                for (const auto& anchor : anchors_)
                 {
-                    extractors_[idx](ua, matches, idx + 1, result);
+                    starts |= delimiters.window(anchor.delimiter, word, anchor.offset);
+                }
+                for (; starts != 0; starts &= starts - 1)
+                {
+                    if (matchAt(ua, word * 64 + static_cast<size_t>(__builtin_ctzll(starts)), captures))
+                    {
+                        return true;
+                    }
                 }
-                return true;
             }
             return false;
         }
+
+    private:
+        struct Bounds
+        {
+            size_t captureBegin;
+            size_t captureEnd;
+            size_t versionBegin;
+            size_t matchEnd;
+        };
+
+    private:
+        static unsigned char byte(const char ch)
+        {
+            return static_cast<unsigned char>(ch);
+        }
+
+        // Anchors every branch on its first atom that only matches
+        // delimiters of one kind, provided no optional atom comes before
+        // it; none if a branch has no such atom.
+        static std::vector<Anchor> anchors(const std::vector<Branch>& branches)
+        {
+            auto anchors = std::vector<Anchor>();
+            for (const auto& branch : branches)
+            {
+                auto anchor = Anchor{Delimiters::COUNT, 0};
+                for (size_t idx = 0; idx < branch.atoms.size() && !branch.atoms[idx].optional; ++idx)
+                {
+                    for (size_t delimiter = 0; delimiter < Delimiters::COUNT; ++delimiter)
+                    {
+                        auto within = true;
+                        for (size_t ch = 0; ch < 256; ++ch)
+                        {
+                            within = within && (!branch.atoms[idx].bytes[ch] || Delimiters::contains(delimiter, ch));
+                        }
+                        if (within)
+                        {
+                            anchor = Anchor{delimiter, idx};
+                            break;
+                        }
+                    }
+                    if (anchor.delimiter != Delimiters::COUNT)
+                    {
+                        break;
+                    }
+                }
+                if (anchor.delimiter == Delimiters::COUNT)
+                {
+                    return std::vector<Anchor>();
+                }
+                if (std::find(anchors.begin(), anchors.end(), anchor) == anchors.end())
+                {
+                    anchors.push_back(anchor);
+                }
+            }
+            return anchors;
+        }
+
+        bool matchAt(StringView ua, const size_t start, Captures& captures) const
+        {
+            if (!first_[byte(ua[start])])
+            {
+                return false;
+            }
+            for (const auto& branch : branches_)
+            {
+                Bounds bounds;
+                if (!matchBranch(ua, branch, 0, start, bounds))
+                {
+                    continue;
+                }
+                captures.size = hasVersion_ ? 3 : 2;
+                captures.groups[0] = ua.substr(start, bounds.matchEnd - start);
+                captures.groups[1] = ua.substr(bounds.captureBegin, bounds.captureEnd - bounds.captureBegin);
+                captures.groups[2] = ua.substr(bounds.versionBegin, bounds.matchEnd - bounds.versionBegin);
+                return true;
+            }
+            return false;
+        }
+
+        // Start of the first group at or after pos, or end if there is none.
+        static size_t findGroup(const std::string& pattern, size_t pos, const size_t end)
+        {
+            while (pos < end && pattern[pos] != '(')
+            {
+                pos = LiteralPrefilter::skipAtom(pattern, pos, end);
+            }
+            return std::min(pos, end);
+        }
+
+        static bool isCapture(const std::string& pattern, const size_t begin, const size_t end)
+        {
+            return pattern.compare(begin, 2, "(?") != 0 && end - begin >= 2 && pattern[end - 1] == ')';
+        }
+
+        // Appends the atoms in [begin, end) to atoms, expanding "{n}" into n
+        // copies; false for anything but single-character atoms.
+        static bool parseAtoms(const RegexImpl::regex& expression,
+                               const size_t begin,
+                               const size_t end,
+                               Atoms& atoms)
+        {
+            const auto pattern = expression.str();
+            for (auto pos = begin; pos < end;)
+            {
+                auto atom = Atom{ByteSet(), false};
+                const auto next = LiteralPrefilter::skipAtom(pattern, pos, end);
+                if (!atomBytes(expression, pos, next, atom.bytes))
+                {
+                    return false;
+                }
+                auto copies = size_t{1};
+                pos = next;
+                if (pos < end && pattern[pos] == '?')
+                {
+                    atom.optional = true;
+                    ++pos;
+                }
+                else if (pos < end && pattern[pos] == '{')
+                {
+                    const auto close = pattern.find('}', pos);
+                    const auto bounds = pattern.substr(pos + 1, close - pos - 1);
+                    if (close >= end || bounds.empty())
+                    {
+                        return false;
+                    }
+                    atom.optional = bounds == "0,1";
+                    copies = atom.optional ? 1 : std::strtoul(bounds.c_str(), nullptr, 10);
+                    if (!atom.optional && bounds.find_first_not_of("0123456789") != std::string::npos)
+                    {
+                        return false;
+                    }
+                    pos = close + 1;
+                }
+                if (pos < end && std::string("?*+{").find(pattern[pos]) != std::string::npos)
+                {
+                    return false;
+                }
+                atoms.insert(atoms.end(), copies, atom);
+            }
+            return true;
+        }
+
+        // Fills bytes with every byte the atom in [begin, end) matches on
+        // its own; false for groups, anchors, assertions and anything else
+        // that is not exactly one character wide.
+        static bool atomBytes(const RegexImpl::regex& expression,
+                              const size_t begin,
+                              const size_t end,
+                              ByteSet& bytes)
+        {
+            const auto pattern = expression.str();
+            if (end <= begin || end > pattern.size())
+            {
+                return false;
+            }
+            const auto ch = pattern[begin];
+            const auto escaped = ch == '\\' ? pattern[begin + 1] : '\0';
+            if (std::string("()|^$*+?{").find(ch) != std::string::npos || ::isdigit(escaped) ||
+                (escaped && std::string("bBAzZ<>`'GKQExuc").find(escaped) != std::string::npos))
+            {
+                return false;
+            }
+            try
+            {
+                const auto atom = RegexImpl::regex(pattern.substr(begin, end - begin), expression.flags());
+                for (int value = 0; value < 256; ++value)
+                {
+                    const auto ch = static_cast<char>(value);
+                    bytes[value] = RegexImpl::regex_match(&ch, &ch + 1, atom);
+                }
+            }
+            catch (const RegexImpl::regex_error&)
+            {
+                return false;
+            }
+            return bytes.any();
+        }
+
+        // Walks the atoms of branch from idx on, trying optional atoms
+        // before skipping them the way the regex engine would; the version
+        // then takes the longest run.
+        bool matchBranch(StringView ua,
+                         const Branch& branch,
+                         const size_t idx,
+                         const size_t pos,
+                         Bounds& bounds) const
+        {
+            if (idx == branch.captureBegin)
+            {
+                bounds.captureBegin = pos;
+            }
+            if (idx == branch.captureEnd)
+            {
+                bounds.captureEnd = pos;
+            }
+            if (idx == branch.atoms.size())
+            {
+                bounds.versionBegin = pos;
+                bounds.matchEnd = pos;
+                while (hasVersion_ && bounds.matchEnd < ua.size() && version_[byte(ua[bounds.matchEnd])])
+                {
+                    ++bounds.matchEnd;
+                }
+                return !hasVersion_ || versionOptional_ || bounds.matchEnd != pos;
+            }
+            const auto& atom = branch.atoms[idx];
+            if (pos < ua.size() && atom.bytes[byte(ua[pos])] &&
+                matchBranch(ua, branch, idx + 1, pos + 1, bounds))
+            {
+                return true;
+            }
+            return atom.optional && matchBranch(ua, branch, idx + 1, pos, bounds);
+        }
+    };
+
+    // An expression as written down, before it is compiled.
+    struct Source
+    {
+        std::string pattern;
+        RegexImpl::regex::flag_type flags;
+
+        Source(std::string p, const RegexImpl::regex::flag_type f = RegexImpl::regex::ECMAScript)
+        : pattern(std::move(p))
+        , flags(f)
+        {
+        }
+    };
+
+    // One entry of getMatcherGroups(): the first expression that matches
+    // feeds capture group n to the n-th extractor.
+    struct Matcher
+    {
+    private:
+        std::vector<Source> expressions_;
+        std::vector<Extractor> extractors_;
+
+    public:
+        Matcher(std::vector<Source> expressions,
+                std::vector<Extractor> extractors)
+        : expressions_(std::move(expressions))
+        , extractors_(std::move(extractors))
+        {
+        }
+        const std::vector<Source>& expressions() const
+        {
+            return expressions_;
+        }
+        const std::vector<Extractor>& extractors() const
+        {
+            return extractors_;
+        }
+    };
+
+    // One entry of getBots(): UAs with any of the tokens in them, which
+    // are lowercase and compared ignoring case.
+    struct Bot
+    {
+        std::string name;
+        std::vector<std::string> tokens;
+    };
+
+    // One entry of getImplications().
+    struct Implication
+    {
+        std::string when;
+        size_t group;
+        std::vector<std::string> then;
+    };
+
+    // getMatcherGroups() flattened into three contiguous arrays that every
+    // parse walks by index: expressions, extractors and the rules slicing
+    // them, with the groups in turn slicing the rules. Expression ids are
+    // positions in expressions() and are shared with LiteralPrefilter.
+    // Expressions are compiled the first time a parse needs them, since
+    // most UAs only ever reach a small part of the table.
+    struct RuleTable
+    {
+    public:
+        struct Compiled
+        {
+            RegexImpl::regex regex;
+            boost::optional<LiteralAlternation> fastPath;
+            boost::optional<RegexBackend::Pattern> pattern; // none where boost has to step in
+            bool folded;                                    // matches Subject::folded rather than Subject::ua
+        };
+
+        struct Rule
+        {
+            uint32_t expressionBegin;
+            uint32_t expressionEnd;
+            uint32_t extractorBegin;
+            uint32_t extractorEnd;
+            FieldMask remainingFields; // written by this rule or a later one of its group
+        };
+
+        struct Group
+        {
+            uint32_t ruleBegin;
+            uint32_t ruleEnd;
+        };
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+    private:
+        std::vector<Source> expressions_;
+        std::vector<Extractor> extractors_;
+        std::vector<Rule> rules_;
+        std::vector<Group> groups_;
+        std::unique_ptr<std::atomic<const Compiled*>[]> compiled_;
+        mutable std::atomic<size_t> compiledCount_;
+        mutable std::atomic<int64_t> compileNanos_;
+#ifdef UAP_RULE_STATS
+        // Every thread counts into its own array, so the counters are
+        // plain relaxed loads and stores; snapshots sum the arrays. A
+        // thread's array is folded into retired when it exits, so thread
+        // churn neither grows the registry nor hands a recycled thread id
+        // the counts of the thread that had it before.
+        struct Counter
+        {
+            std::atomic<uint64_t> attempts{0};
+            std::atomic<uint64_t> hits{0};
+            std::atomic<uint64_t> nanos{0};
+
+            void add(const Counter& other)
+            {
+                attempts.store(attempts.load(std::memory_order_relaxed) + other.attempts.load(std::memory_order_relaxed),
+                               std::memory_order_relaxed);
+                hits.store(hits.load(std::memory_order_relaxed) + other.hits.load(std::memory_order_relaxed),
+                           std::memory_order_relaxed);
+                nanos.store(nanos.load(std::memory_order_relaxed) + other.nanos.load(std::memory_order_relaxed),
+                            std::memory_order_relaxed);
+            }
+        };
+
+        // Shared with the threads counting into it, which may outlive the
+        // table.
+        struct CounterRegistry
+        {
+            const size_t size;
+            std::mutex mutex;
+            std::unordered_map<std::thread::id, std::unique_ptr<Counter[]>> byThread;
+            std::unique_ptr<Counter[]> retired;
+
+            explicit CounterRegistry(const size_t expressionCount)
+            : size(expressionCount)
+            , mutex()
+            , byThread()
+            , retired(new Counter[expressionCount])
+            {
+            }
+
+            void retire(const std::thread::id thread)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                const auto it = byThread.find(thread);
+                if (it == byThread.end())
+                {
+                    return;
+                }
+                for (size_t id = 0; id < size; ++id)
+                {
+                    retired[id].add(it->second[id]);
+                }
+                byThread.erase(it);
+            }
+        };
+
+        // The registries a thread counts into, retired from at thread exit.
+        struct ThreadRegistrations
+        {
+            std::vector<std::weak_ptr<CounterRegistry>> registries;
+
+            ~ThreadRegistrations()
+            {
+                for (const auto& registry : registries)
+                {
+                    if (const auto alive = registry.lock())
+                    {
+                        alive->retire(std::this_thread::get_id());
+                    }
+                }
+            }
+
+            void add(const std::shared_ptr<CounterRegistry>& registry)
+            {
+                registries.erase(std::remove_if(registries.begin(),
+                                                registries.end(),
+                                                [](const std::weak_ptr<CounterRegistry>& r) { return r.expired(); }),
+                                 registries.end());
+                registries.push_back(registry);
+            }
+        };
+
+        uint64_t tableId_; // tells tables apart for the per-thread lookup
+        std::shared_ptr<CounterRegistry> counters_;
+#endif
+
+    public:
+        explicit RuleTable(const std::vector<MatcherGroup>& matcherGroups)
+        : expressions_()
+        , extractors_()
+        , rules_()
+        , groups_()
+        , compiled_()
+        , compiledCount_(0)
+        , compileNanos_(0)
+#ifdef UAP_RULE_STATS
+        , tableId_(nextTableId())
+        , counters_()
+#endif
+        {
+            for (const auto& matcherGroup : matcherGroups)
+            {
+                const auto ruleBegin = static_cast<uint32_t>(rules_.size());
+                for (const auto& matcher : matcherGroup)
+                {
+                    auto rule = Rule();
+                    rule.expressionBegin = static_cast<uint32_t>(expressions_.size());
+                    for (const auto& expression : matcher.expressions())
+                    {
+                        expressions_.push_back(expression);
+                    }
+                    rule.expressionEnd = static_cast<uint32_t>(expressions_.size());
+                    rule.extractorBegin = static_cast<uint32_t>(extractors_.size());
+                    rule.remainingFields = 0;
+                    for (const auto& extractor : matcher.extractors())
+                    {
+                        extractors_.push_back(extractor);
+                        rule.remainingFields |= extractor.field();
+                    }
+                    rule.extractorEnd = static_cast<uint32_t>(extractors_.size());
+                    rules_.push_back(rule);
+                }
+                const auto ruleEnd = static_cast<uint32_t>(rules_.size());
+                for (auto idx = ruleEnd; idx > ruleBegin + 1; --idx)
+                {
+                    rules_[idx - 2].remainingFields |= rules_[idx - 1].remainingFields;
+                }
+                groups_.push_back(Group{ruleBegin, ruleEnd});
+            }
+            compiled_.reset(new std::atomic<const Compiled*>[expressions_.size()]);
+            for (size_t id = 0; id < expressions_.size(); ++id)
+            {
+                compiled_[id].store(nullptr);
+            }
+#ifdef UAP_RULE_STATS
+            counters_ = std::make_shared<CounterRegistry>(expressions_.size());
+#endif
+        }
+
+        RuleTable(const RuleTable&) = delete;
+        RuleTable& operator=(const RuleTable&) = delete;
+
+        ~RuleTable()
+        {
+            for (size_t id = 0; id < expressions_.size(); ++id)
+            {
+                delete compiled_[id].load();
+            }
+        }
+
+        const std::vector<Source>& expressions() const
+        {
+            return expressions_;
+        }
+
+        // Compiles the expression the first time it is asked for; later
+        // calls are a single load. Threads racing on the first call may each
+        // compile it, the first to publish its copy wins.
+        const Compiled& compiled(const size_t id) const
+        {
+            auto* current = compiled_[id].load(std::memory_order_acquire);
+            if (current)
+            {
+                return *current;
+            }
+            const auto start = Clock::now();
+            const auto& source = expressions_[id];
+            const auto folded = (source.flags & RegexImpl::regex::icase) ? foldPattern(source.pattern) : boost::none;
+            RegexImpl::regex::flag_type caseSensitive = source.flags & ~RegexImpl::regex::icase;
+            const auto regex = folded ? RegexImpl::regex(*folded, caseSensitive)
+                                      : RegexImpl::regex(source.pattern, source.flags);
+            auto fresh = std::unique_ptr<const Compiled>(new Compiled{
+                regex, LiteralAlternation::compile(regex), RegexBackend::compile(regex), static_cast<bool>(folded)});
+            if (!compiled_[id].compare_exchange_strong(current, fresh.get(), std::memory_order_acq_rel))
+            {
+                return *current;
+            }
+            compileNanos_ += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+            ++compiledCount_;
+            return *fresh.release();
+        }
+
+        void warmup() const
+        {
+            for (size_t id = 0; id < expressions_.size(); ++id)
+            {
+                compiled(id);
+            }
+        }
+
+        size_t compiledCount() const
+        {
+            return compiledCount_.load();
+        }
+
+        std::chrono::nanoseconds compileTime() const
+        {
+            return std::chrono::nanoseconds(compileNanos_.load());
+        }
+
+        std::vector<ExpressionStats> stats() const
+        {
+            auto stats = std::vector<ExpressionStats>();
+#ifdef UAP_RULE_STATS
+            for (size_t groupIdx = 0; groupIdx < groups_.size(); ++groupIdx)
+            {
+                const auto& group = groups_[groupIdx];
+                for (auto ruleIdx = group.ruleBegin; ruleIdx < group.ruleEnd; ++ruleIdx)
+                {
+                    const auto& rule = rules_[ruleIdx];
+                    for (auto id = rule.expressionBegin; id < rule.expressionEnd; ++id)
+                    {
+                        stats.push_back(ExpressionStats{groupIdx, ruleIdx - group.ruleBegin, expressions_[id].pattern,
+                                                        0, 0, std::chrono::nanoseconds(0)});
+                    }
+                }
+            }
+            const auto addCounters = [&stats](const Counter* counters) {
+                for (size_t id = 0; id < stats.size(); ++id)
+                {
+                    const auto& counter = counters[id];
+                    stats[id].attempts += counter.attempts.load(std::memory_order_relaxed);
+                    stats[id].hits += counter.hits.load(std::memory_order_relaxed);
+                    stats[id].searchTime += std::chrono::nanoseconds(counter.nanos.load(std::memory_order_relaxed));
+                }
+            };
+            std::lock_guard<std::mutex> lock(counters_->mutex);
+            addCounters(counters_->retired.get());
+            for (const auto& threadCounters : counters_->byThread)
+            {
+                addCounters(threadCounters.second.get());
+            }
+#endif
+            return stats;
+        }
+
+        const std::vector<Extractor>& extractors() const
+        {
+            return extractors_;
+        }
+
+        const std::vector<Rule>& rules() const
+        {
+            return rules_;
+        }
+
+        const std::vector<Group>& groups() const
+        {
+            return groups_;
+        }
+
+        // Whether any of the rule's candidate expressions matches ua.
+        bool matches(const Rule& rule, const Subject& subject, const std::vector<bool>& candidates, Budget& budget) const
+        {
+            Captures captures;
+            for (auto id = rule.expressionBegin; id < rule.expressionEnd; ++id)
+            {
+                if (candidates[id] && search(id, subject, budget, captures))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // The table as matcher groups again, the rules of every group in
+        // the given order.
+        std::vector<MatcherGroup> matcherGroups(const std::vector<std::vector<size_t>>& order) const
+        {
+            if (order.size() != groups_.size())
+            {
+                throw std::invalid_argument("Rule order has to cover every group");
+            }
+            auto matcherGroups = std::vector<MatcherGroup>();
+            for (size_t groupIdx = 0; groupIdx < groups_.size(); ++groupIdx)
+            {
+                const auto& group = groups_[groupIdx];
+                auto seen = std::vector<bool>(group.ruleEnd - group.ruleBegin, false);
+                auto matcherGroup = MatcherGroup();
+                for (const auto ruleIdx : order[groupIdx])
+                {
+                    if (ruleIdx >= seen.size() || seen[ruleIdx])
+                    {
+                        throw std::invalid_argument("Rule order is not a permutation");
+                    }
+                    seen[ruleIdx] = true;
+                    const auto& rule = rules_[group.ruleBegin + ruleIdx];
+                    matcherGroup.emplace_back(
+                        std::vector<Source>(expressions_.begin() + rule.expressionBegin,
+                                            expressions_.begin() + rule.expressionEnd),
+                        std::vector<Extractor>(extractors_.begin() + rule.extractorBegin,
+                                               extractors_.begin() + rule.extractorEnd));
+                }
+                if (matcherGroup.size() != seen.size())
+                {
+                    throw std::invalid_argument("Rule order is not a permutation");
+                }
+                matcherGroups.push_back(std::move(matcherGroup));
+            }
+            return matcherGroups;
+        }
+
+        // Runs the extractors of the requested fields for the first of the
+        // rule's candidate expressions that matches ua.
+        bool match(const Rule& rule,
+                   const Subject& subject,
+                   const std::vector<bool>& candidates,
+                   const FieldMask fields,
+                   Budget& budget,
+                   ResultView& result) const
+        {
+            Captures captures;
+            for (auto id = rule.expressionBegin; id < rule.expressionEnd; ++id)
+            {
+                if (!candidates[id])
+                {
+                    continue;
+                }
+                if (!search(id, subject, budget, captures))
+                {
+                    if (budget.exceeded())
+                    {
+                        return false;
+                    }
+                    continue;
+                }
+                for (auto idx = rule.extractorBegin; idx < rule.extractorEnd; ++idx)
+                {
+                    const auto& extractor = extractors_[idx];
+                    if (extractor.field() & fields)
+                    {
+                        extractor(subject.ua, captures, idx - rule.extractorBegin + 1, result);
+                    }
+                }
+                return true;
+            }
+            return false;
+        }
+
+    private:
+        // Leaves the budget exceeded, and reports no match, when it ran out
+        // before the search or the regex engine gave up on it. Captures are
+        // always ranges of the UA as given.
+        bool search(const size_t id, const Subject& subject, Budget& budget, Captures& captures) const
+        {
+            const auto& expression = compiled(id);
+            const auto text = expression.folded ? subject.folded : subject.ua;
+#ifdef UAP_RULE_STATS
+            const auto start = Clock::now();
+            const auto found = search(expression, text, subject, budget, captures);
+            const auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+            auto& counter = threadCounters()[id];
+            counter.attempts.store(counter.attempts.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            counter.hits.store(counter.hits.load(std::memory_order_relaxed) + found, std::memory_order_relaxed);
+            counter.nanos.store(counter.nanos.load(std::memory_order_relaxed) + nanos, std::memory_order_relaxed);
+#else
+            const auto found = search(expression, text, subject, budget, captures);
+#endif
+            if (found && expression.folded)
+            {
+                for (size_t group = 0; group < captures.size; ++group)
+                {
+                    captures.groups[group] = subject.original(captures.groups[group]);
+                }
+            }
+            return found;
+        }
+
+#ifdef UAP_RULE_STATS
+        Counter* threadCounters() const
+        {
+            static thread_local uint64_t cachedTableId = 0;
+            static thread_local Counter* cached = nullptr;
+            static thread_local ThreadRegistrations registrations;
+            if (cachedTableId != tableId_)
+            {
+                std::lock_guard<std::mutex> lock(counters_->mutex);
+                auto& counters = counters_->byThread[std::this_thread::get_id()];
+                if (!counters)
+                {
+                    counters.reset(new Counter[expressions_.size()]);
+                    registrations.add(counters_);
+                }
+                cached = counters.get();
+                cachedTableId = tableId_;
+            }
+            return cached;
+        }
+
+        static uint64_t nextTableId()
+        {
+            static std::atomic<uint64_t> next{1};
+            return next++;
+        }
+#endif
+
+        // The case-insensitive pattern as one matching the same lowercased
+        // UAs case-sensitively: letters lowercased, except in class escapes
+        // such as \W. Patterns using other letter escapes, POSIX classes,
+        // inline modifiers or ranges spanning both cases stay as they are.
+        static boost::optional<std::string> foldPattern(const std::string& pattern)
+        {
+            const auto isUpper = [](const char ch) { return ch >= 'A' && ch <= 'Z'; };
+            const auto isLower = [](const char ch) { return ch >= 'a' && ch <= 'z'; };
+            const auto isLetter = [&](const char ch) { return isUpper(ch) || isLower(ch); };
+            auto result = std::string();
+            auto inClass = false;
+            for (size_t pos = 0; pos < pattern.size(); ++pos)
+            {
+                const auto ch = pattern[pos];
+                const auto next = pos + 1 < pattern.size() ? pattern[pos + 1] : '\0';
+                if (ch == '\\')
+                {
+                    const auto rangeStart = inClass && pos + 3 < pattern.size() && pattern[pos + 2] == '-' &&
+                                            pattern[pos + 3] != ']';
+                    if ((isLetter(next) && !std::strchr("dDsSwWbB", next)) || rangeStart)
+                    {
+                        return boost::none;
+                    }
+                    result += ch;
+                    result += next;
+                    ++pos;
+                    continue;
+                }
+                if (inClass && ch == '[' && (next == ':' || next == '=' || next == '.'))
+                {
+                    return boost::none;
+                }
+                if (!inClass && ch == '(' && next == '?' && pos + 2 < pattern.size() && isLetter(pattern[pos + 2]))
+                {
+                    return boost::none;
+                }
+                if (inClass && next == '-' && pos + 2 < pattern.size() && pattern[pos + 2] != ']')
+                {
+                    const auto last = pattern[pos + 2];
+                    const auto sameCase = (isUpper(ch) && isUpper(last)) || (isLower(ch) && isLower(last));
+                    const auto noLetters = last < 'A' || ch > 'z' || (ch > 'Z' && last < 'a');
+                    if (last == '\\' || !(sameCase || noLetters))
+                    {
+                        return boost::none;
+                    }
+                }
+                if (ch == '[' && !inClass)
+                {
+                    inClass = true;
+                }
+                else if (ch == ']' && inClass)
+                {
+                    inClass = false;
+                }
+                result += isUpper(ch) ? static_cast<char>(ch - 'A' + 'a') : ch;
+            }
+            return result;
+        }
+
+        // ua is subject.ua or subject.folded, whichever expression matches.
+        static bool search(const Compiled& expression,
+                           StringView ua,
+                           const Subject& subject,
+                           Budget& budget,
+                           Captures& captures)
+        {
+            if (expression.fastPath)
+            {
+                return (*expression.fastPath)(ua, subject.delimiters, captures);
+            }
+            if (budget.expired())
+            {
+                return false;
+            }
+            try
+            {
+                if (expression.pattern)
+                {
+                    return RegexBackend::search(*expression.pattern, ua, subject.matches, captures);
+                }
+                return BoostBackend::search(expression.regex, ua, subject.matches, captures);
+            }
+            catch (const std::runtime_error&)
+            {
+                budget.exceed();
+                return false;
+            }
+        }
+    };
+
+    // Finds, for every expression in the rule table, a set of literals
+    // one of which has to be present in any UA the expression can match.
+    // A single Aho-Corasick pass over the lowercased UA then yields the
+    // expressions worth handing to the regex engine; expressions we cannot
+    // extract literals from are always candidates.
+    struct LiteralPrefilter
+    {
+    private:
+        friend struct LiteralAlternation;
+
+        using Literals = std::vector<std::string>;
+
+        struct Sequence
+        {
+            std::string run;
+            std::vector<Literals> clauses;
+
+            void flush()
+            {
+                if (!run.empty())
+                {
+                    clauses.push_back({run});
+                    run.clear();
+                }
+            }
+        };
+
+    private:
+        std::vector<bool> always_;
+        std::vector<unsigned char> classes_;
+        size_t classCount_;
+        std::vector<uint32_t> delta_;
+        std::vector<uint32_t> outputOffsets_;
+        std::vector<uint32_t> outputs_;
+
+    public:
+        // Candidates past the expressions stand for extra[i], any of which,
+        // lowercase, has to be present.
+        LiteralPrefilter(const RuleTable& rules, const std::vector<Literals>& extra)
+        : always_()
+        , classes_(256, 0)
+        , classCount_(1)
+        , delta_()
+        , outputOffsets_()
+        , outputs_()
+        {
+            auto literals = std::vector<Literals>();
+            for (const auto& expression : rules.expressions())
+            {
+                literals.push_back(requiredLiterals(expression.pattern));
+            }
+            literals.insert(literals.end(), extra.begin(), extra.end());
+            build(literals);
+        }
+
+        std::vector<bool> scan(StringView ua) const
+        {
+            auto candidates = std::vector<bool>();
+            scan(ua, candidates);
+            return candidates;
+        }
+
+        // Overwrites candidates, reusing its storage.
+        void scan(StringView ua, std::vector<bool>& candidates) const
+        {
+            candidates = always_;
+            uint32_t state = 0;
+            for (const auto ch : ua)
+            {
+                state = delta_[state * classCount_ + classes_[static_cast<unsigned char>(ch)]];
+                for (auto idx = outputOffsets_[state]; idx < outputOffsets_[state + 1]; ++idx)
+                {
+                    candidates[outputs_[idx]] = true;
+                }
+            }
+        }
+
+    private:
+        void build(const std::vector<Literals>& literals)
+        {
+            always_.assign(literals.size(), false);
+            for (const auto& alternatives : literals)
+            {
+                for (const auto& literal : alternatives)
+                {
+                    for (const auto ch : literal)
+                    {
+                        auto& cls = classes_[static_cast<unsigned char>(ch)];
+                        if (cls == 0)
+                        {
+                            cls = static_cast<unsigned char>(classCount_++);
+                        }
+                    }
+                }
+            }
+            for (int ch = 'A'; ch <= 'Z'; ++ch)
+            {
+                classes_[ch] = classes_[::tolower(ch)];
+            }
+
+            // Plain trie first, transitions to state 0 mean "missing".
+            auto trie = std::vector<uint32_t>(classCount_, 0);
+            auto terminals = std::vector<std::vector<uint32_t>>(1);
+            for (size_t id = 0; id < literals.size(); ++id)
+            {
+                if (literals[id].empty())
+                {
+                    always_[id] = true;
+                    continue;
+                }
+                for (const auto& literal : literals[id])
+                {
+                    uint32_t state = 0;
+                    for (const auto ch : literal)
+                    {
+                        const auto cls = classes_[static_cast<unsigned char>(ch)];
+                        if (trie[state * classCount_ + cls] == 0)
+                        {
+                            trie[state * classCount_ + cls] = static_cast<uint32_t>(terminals.size());
+                            trie.resize(trie.size() + classCount_, 0);
+                            terminals.emplace_back();
+                        }
+                        state = trie[state * classCount_ + cls];
+                    }
+                    terminals[state].push_back(static_cast<uint32_t>(id));
+                }
+            }
+
+            // Breadth-first pass turning the trie into a complete automaton,
+            // folding the outputs of every failure state into its children.
+            const auto stateCount = terminals.size();
+            delta_.assign(stateCount * classCount_, 0);
+            auto fail = std::vector<uint32_t>(stateCount, 0);
+            auto order = std::vector<uint32_t>{0};
+            for (size_t head = 0; head < order.size(); ++head)
+            {
+                const auto state = order[head];
+                if (state != 0)
+                {
+                    const auto& inherited = terminals[fail[state]];
+                    terminals[state].insert(terminals[state].end(), inherited.begin(), inherited.end());
+                }
+                for (size_t cls = 1; cls < classCount_; ++cls)
+                {
+                    const auto next = trie[state * classCount_ + cls];
+                    if (next == 0)
+                    {
+                        delta_[state * classCount_ + cls] = state == 0 ? 0 : delta_[fail[state] * classCount_ + cls];
+                        continue;
+                    }
+                    fail[next] = state == 0 ? 0 : delta_[fail[state] * classCount_ + cls];
+                    delta_[state * classCount_ + cls] = next;
+                    order.push_back(next);
+                }
+            }
+
+            outputOffsets_.push_back(0);
+            for (const auto& ids : terminals)
+            {
+                outputs_.insert(outputs_.end(), ids.begin(), ids.end());
+                outputOffsets_.push_back(static_cast<uint32_t>(outputs_.size()));
+            }
+        }
+
+        // Returns the strongest clause of lowercased literals guaranteed by
+        // the ECMAScript pattern, or an empty list when there is none.
+        static Literals requiredLiterals(const std::string& pattern)
+        {
+            const auto clauses = parseAlternation(pattern, 0, pattern.size());
+            return bestClause(clauses);
+        }
+
+        static Literals bestClause(const std::vector<Literals>& clauses)
+        {
+            auto best = Literals();
+            size_t bestLength = 0;
+            for (const auto& clause : clauses)
+            {
+                size_t length = std::numeric_limits<size_t>::max();
+                for (const auto& literal : clause)
+                {
+                    length = std::min(length, literal.size());
+                }
+                if (length > bestLength ||
+                    (length == bestLength && clause.size() < best.size()))
+                {
+                    best = clause;
+                    bestLength = length;
+                }
+            }
+            return best;
+        }
+
+        static std::vector<Literals> parseAlternation(const std::string& pattern,
+                                                      const size_t begin,
+                                                      const size_t end)
+        {
+            auto branches = std::vector<std::vector<Literals>>();
+            auto branchBegin = begin;
+            for (auto pos = begin; pos <= end; pos = skipAtom(pattern, pos, end))
+            {
+                if (pos == end || pattern[pos] == '|')
+                {
+                    auto sequence = Sequence();
+                    parseSequence(pattern, branchBegin, pos, sequence);
+                    sequence.flush();
+                    branches.push_back(std::move(sequence.clauses));
+                    branchBegin = pos + 1;
+                    if (pos == end)
+                    {
+                        break;
+                    }
+                }
+            }
+            if (branches.size() == 1)
+            {
+                return branches.front();
+            }
+
+            auto alternatives = Literals();
+            for (const auto& branch : branches)
+            {
+                const auto clause = bestClause(branch);
+                if (clause.empty())
+                {
+                    return {};
+                }
+                alternatives.insert(alternatives.end(), clause.begin(), clause.end());
+            }
+            std::sort(alternatives.begin(), alternatives.end());
+            alternatives.erase(std::unique(alternatives.begin(), alternatives.end()), alternatives.end());
+            return {alternatives};
+        }
+
+        static void parseSequence(const std::string& pattern,
+                                  const size_t begin,
+                                  const size_t end,
+                                  Sequence& sequence)
+        {
+            auto pos = begin;
+            while (pos < end)
+            {
+                const auto atomEnd = skipAtom(pattern, pos, end);
+                size_t minRepeat = 1;
+                const auto next = skipQuantifier(pattern, atomEnd, end, minRepeat);
+                const auto quantified = next != atomEnd;
+                const auto ch = pattern[pos];
+
+                if (ch == '(')
+                {
+                    const auto lookaround = pattern.compare(pos, 3, "(?=") == 0 ||
+                                            pattern.compare(pos, 3, "(?!") == 0 ||
+                                            pattern.compare(pos, 3, "(?<") == 0;
+                    const auto innerBegin = pattern.compare(pos, 3, "(?:") == 0 ? pos + 3 : pos + 1;
+                    const auto innerEnd = atomEnd - 1;
+                    if (lookaround || minRepeat == 0)
+                    {
+                        sequence.flush();
+                    }
+                    else if (hasAlternation(pattern, innerBegin, innerEnd))
+                    {
+                        sequence.flush();
+                        for (auto& clause : parseAlternation(pattern, innerBegin, innerEnd))
+                        {
+                            sequence.clauses.push_back(std::move(clause));
+                        }
+                    }
+                    else
+                    {
+                        if (quantified)
+                        {
+                            sequence.flush();
+                        }
+                        parseSequence(pattern, innerBegin, innerEnd, sequence);
+                        if (quantified)
+                        {
+                            sequence.flush();
+                        }
+                    }
+                }
+                else if (isLiteralAtom(pattern, pos))
+                {
+                    const auto literal = static_cast<char>(::tolower(ch == '\\' ? pattern[pos + 1] : ch));
+                    if (minRepeat == 0)
+                    {
+                        sequence.flush();
+                    }
+                    else
+                    {
+                        sequence.run += literal;
+                        if (quantified)
+                        {
+                            sequence.flush();
+                            sequence.run += literal;
+                        }
+                    }
+                }
+                else
+                {
+                    sequence.flush();
+                }
+                pos = next;
+            }
+        }
+
+        static bool isLiteralAtom(const std::string& pattern, const size_t pos)
+        {
+            const auto ch = pattern[pos];
+            if (ch == '\\')
+            {
+                const auto escaped = static_cast<unsigned char>(pattern[pos + 1]);
+                return !::isalnum(escaped);
+            }
+            return std::string("[.^$").find(ch) == std::string::npos;
+        }
+
+        static bool hasAlternation(const std::string& pattern,
+                                   const size_t begin,
+                                   const size_t end)
+        {
+            for (auto pos = begin; pos < end; pos = skipAtom(pattern, pos, end))
+            {
+                if (pattern[pos] == '|')
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Returns the position just past the atom starting at pos, treating
+        // quantifiers and '|' as atoms of their own.
+        static size_t skipAtom(const std::string& pattern,
+                               const size_t pos,
+                               const size_t end)
+        {
+            if (pos >= end)
+            {
+                return end + 1;
+            }
+            switch (pattern[pos])
+            {
+            case '\\':
+                return std::min(pos + 2, end);
+            case '[':
+            {
+                auto idx = pos + 1;
+                if (idx < end && pattern[idx] == '^')
+                {
+                    ++idx;
+                }
+                for (; idx < end && pattern[idx] != ']'; ++idx)
+                {
+                    if (pattern[idx] == '\\')
+                    {
+                        ++idx;
+                    }
+                }
+                return std::min(idx + 1, end);
+            }
+            case '(':
+            {
+                auto depth = 0;
+                for (auto idx = pos; idx < end;)
+                {
+                    if (pattern[idx] == '\\' || pattern[idx] == '[')
+                    {
+                        idx = skipAtom(pattern, idx, end);
+                        continue;
+                    }
+                    if (pattern[idx] == '(')
+                    {
+                        ++depth;
+                    }
+                    else if (pattern[idx] == ')' && --depth == 0)
+                    {
+                        return idx + 1;
+                    }
+                    ++idx;
+                }
+                return end;
+            }
+            default:
+                return pos + 1;
+            }
+        }
+
+        static size_t skipQuantifier(const std::string& pattern,
+                                     const size_t pos,
+                                     size_t end,
+                                     size_t& minRepeat)
+        {
+            auto next = pos;
+            if (next < end && (pattern[next] == '?' || pattern[next] == '*'))
+            {
+                minRepeat = 0;
+                ++next;
+            }
+            else if (next < end && pattern[next] == '+')
+            {
+                ++next;
+            }
+            else if (next < end && pattern[next] == '{')
+            {
+                const auto close = pattern.find('}', next);
+                if (close == std::string::npos || close >= end)
+                {
+                    return pos;
+                }
+                minRepeat = std::strtoul(pattern.c_str() + next + 1, nullptr, 10);
+                next = close + 1;
+            }
+            if (next != pos && next < end && pattern[next] == '?')
+            {
+                ++next;
+            }
+            return next;
+        }
+    };
+
+    // A rule table ready to parse with, and the prefilter for it.
+    struct RuleSet
+    {
+    private:
+        using Clock = std::chrono::steady_clock;
+
+    public:
+        RuleTable table;
+        LiteralPrefilter prefilter;
+        std::vector<std::vector<uint32_t>> implied; // per rule, the rules its implications rule out
+        uint64_t version;
+        std::chrono::nanoseconds buildTime; // table and prefilter, no expressions
+
+    public:
+        // Builtin tables are getMatcherGroups() as written down; every other
+        // table may have been reordered or saved by another version.
+        enum class Source
+        {
+            Builtin,
+            Other,
+        };
+
+    public:
+        explicit RuleSet(const std::vector<MatcherGroup>& matcherGroups, const Source source = Source::Other)
+        : RuleSet(matcherGroups, source, Clock::now())
+        {
+        }
+
+    private:
+        RuleSet(const std::vector<MatcherGroup>& matcherGroups, const Source source, const Clock::time_point start)
+        : table(matcherGroups)
+        , prefilter(table, getBotTokens())
+        , implied(resolve(table, getImplications(), source))
+        , version(versionOf(table))
+        , buildTime(Clock::now() - start)
+        {
+        }
+
+        // What formatters do beyond their mapping tables; bump it with any
+        // change to how an Extractor::Format turns a capture into a value.
+        enum : uint32_t
+        {
+            FORMATTER_REVISION = 1,
+        };
+
+        // The bots are detected along with the rules, and the formatters'
+        // tables and revision shape the values, so they count too.
+        static uint64_t versionOf(const RuleTable& table)
+        {
+            auto bytes = RuleFile::serialize(table);
+            for (const auto& bot : getBots())
+            {
+                bytes += bot.name;
+                for (const auto& token : bot.tokens)
+                {
+                    bytes += '\0' + token;
+                }
+                bytes += '\n';
+            }
+            bytes += std::to_string(FORMATTER_REVISION) + '\n';
+            appendMapping(bytes, FnFixSafariVersion::mapping());
+            appendMapping(bytes, FnFixAmazonDeviceModel::mapping());
+            appendMapping(bytes, FnFixWindowsVersion::mapping());
+            appendMapping(bytes, FnFixSprintDeviceModel::mapping());
+            appendMapping(bytes, FnFixSprintDeviceVendor::mapping());
+            return fnv1a(bytes);
+        }
+
+        template <size_t N>
+        static void appendMapping(std::string& bytes, const Mapping (&mapping)[N])
+        {
+            for (const auto& entry : mapping)
+            {
+                bytes.append(entry.key, entry.keySize).append(1, '\0');
+                bytes.append(entry.value, entry.valueSize).append(1, '\0');
+            }
+            bytes += '\n';
+        }
+
+        // Rules are found by their first expression. An implication naming
+        // a rule the table lacks, or pointing back to an earlier group, is
+        // dropped, unless the table is the builtin one: then the
+        // implication is wrong, and throws std::logic_error.
+        static std::vector<std::vector<uint32_t>> resolve(const RuleTable& table,
+                                                          const std::vector<Implication>& implications,
+                                                          const Source source)
+        {
+            const auto& groups = table.groups();
+            const auto find = [&table](const size_t groupIdx, const std::string& pattern) {
+                const auto& group = table.groups()[groupIdx];
+                for (auto ruleIdx = group.ruleBegin; ruleIdx < group.ruleEnd; ++ruleIdx)
+                {
+                    const auto& rule = table.rules()[ruleIdx];
+                    if (rule.expressionBegin != rule.expressionEnd &&
+                        table.expressions()[rule.expressionBegin].pattern == pattern)
+                    {
+                        return ruleIdx;
+                    }
+                }
+                return group.ruleEnd;
+            };
+
+            auto implied = std::vector<std::vector<uint32_t>>(table.rules().size());
+            for (const auto& implication : implications)
+            {
+                if (implication.group >= groups.size())
+                {
+                    if (source == Source::Builtin)
+                    {
+                        throw std::logic_error("Implication for an unknown group: " + implication.when);
+                    }
+                    continue;
+                }
+                auto when = table.rules().size();
+                for (size_t groupIdx = 0; groupIdx < implication.group && when == table.rules().size(); ++groupIdx)
+                {
+                    const auto ruleIdx = find(groupIdx, implication.when);
+                    when = ruleIdx != groups[groupIdx].ruleEnd ? ruleIdx : when;
+                }
+                const auto& group = groups[implication.group];
+                auto allowed = std::vector<bool>(group.ruleEnd - group.ruleBegin, false);
+                auto resolved = when != table.rules().size();
+                for (const auto& pattern : implication.then)
+                {
+                    const auto ruleIdx = find(implication.group, pattern);
+                    resolved = resolved && ruleIdx != group.ruleEnd;
+                    if (ruleIdx != group.ruleEnd)
+                    {
+                        allowed[ruleIdx - group.ruleBegin] = true;
+                    }
+                }
+                if (!resolved)
+                {
+                    if (source == Source::Builtin)
+                    {
+                        throw std::logic_error("Implication names a rule the builtin table lacks: " + implication.when);
+                    }
+                    continue;
+                }
+                for (auto ruleIdx = group.ruleBegin; ruleIdx < group.ruleEnd; ++ruleIdx)
+                {
+                    if (!allowed[ruleIdx - group.ruleBegin])
+                    {
+                        implied[when].push_back(ruleIdx);
+                    }
+                }
+            }
+            return implied;
+        }
+    };
+
+    // Where a parser and its copies find their rules, read-copy-update
+    // style: parses never lock, they only announce themselves on a reader
+    // counter of the current epoch. Each epoch's counter is striped over
+    // cache lines, every thread sticking to one stripe, so that parses on
+    // different cores do not bounce a shared line. Publishing new rules
+    // swaps the pointer, moves on to the next epoch and waits for every
+    // stripe of the previous one to drain before the old rules are
+    // released.
+    struct RuleSlot
+    {
+    private:
+        static const size_t STRIPE_COUNT = 16;
+
+        struct Stripe
+        {
+            std::atomic<uint64_t> readers{0};
+            char padding[64]; // keeps neighbouring stripes on separate cache lines
+        };
+
+    public:
+        struct Reader
+        {
+        private:
+            std::atomic<uint64_t>* counter_;
+            const RuleSet* rules_;
+
+        public:
+            Reader(std::atomic<uint64_t>& counter, const RuleSet& rules)
+            : counter_(&counter)
+            , rules_(&rules)
+            {
+            }
+            Reader(Reader&& other)
+            : counter_(other.counter_)
+            , rules_(other.rules_)
+            {
+                other.counter_ = nullptr;
+            }
+            Reader(const Reader&) = delete;
+            Reader& operator=(const Reader&) = delete;
+            ~Reader()
+            {
+                if (counter_)
+                {
+                    counter_->fetch_sub(1);
+                }
+            }
+            const RuleSet& rules() const
+            {
+                return *rules_;
+            }
+        };
+
+    private:
+        std::mutex writerMutex_;
+        std::shared_ptr<const RuleSet> owner_;
+        std::atomic<const RuleSet*> current_;
+        std::atomic<uint64_t> epoch_;
+        Stripe stripes_[2][STRIPE_COUNT];
+
+    public:
+        explicit RuleSlot(std::shared_ptr<const RuleSet> rules)
+        : writerMutex_()
+        , owner_(std::move(rules))
+        , current_(owner_.get())
+        , epoch_(0)
+        , stripes_()
+        {
+        }
+
+        // A reader that raced with a publish cannot tell which rules it
+        // got, so it backs off and tries again.
+        Reader read()
+        {
+            const auto stripe = threadStripe();
+            while (true)
+            {
+                const auto epoch = epoch_.load();
+                auto& counter = stripes_[epoch & 1][stripe].readers;
+                counter.fetch_add(1);
+                const auto rules = current_.load();
+                if (epoch_.load() == epoch)
+                {
+                    return Reader(counter, *rules);
+                }
+                counter.fetch_sub(1);
+            }
+        }
+
+        void publish(std::shared_ptr<const RuleSet> rules)
+        {
+            auto previous = std::shared_ptr<const RuleSet>();
+            {
+                std::lock_guard<std::mutex> lock(writerMutex_);
+                previous = std::move(owner_);
+                owner_ = std::move(rules);
+                current_.store(owner_.get());
+                // Readers arriving on a stripe after it was checked see the
+                // new epoch and back off, so one pass over them is enough.
+                const auto epoch = epoch_.fetch_add(1);
+                for (auto& stripe : stripes_[epoch & 1])
+                {
+                    while (stripe.readers.load() != 0)
+                    {
+                        std::this_thread::yield();
+                    }
+                }
+            }
+        }
+
+    private:
+        static size_t threadStripe()
+        {
+            static std::atomic<size_t> next{0};
+            static thread_local const size_t stripe = next++ % STRIPE_COUNT;
+            return stripe;
+        }
+    };
+
+    // Binary rule file: a header, then the groups, rules, expressions and
+    // extractors of a RuleTable as fixed-size records in host byte order,
+    // then the pattern and constant strings they point into. Files are
+    // memory-mapped and checked record by record before anything is built
+    // from them. Constants are interned for the life of the process, so
+    // the views results hold on them survive a reload.
+    struct RuleFile
+    {
+    private:
+        static const uint32_t FORMAT_VERSION = 1;
+        static const uint32_t ICASE = 1u << 0;
+        // Browser, cpu, device, engine and os, as Fields and
+        // getImplications() number them.
+        static const uint32_t GROUP_COUNT = 5;
+
+        struct Header
+        {
+            char magic[4];
+            uint32_t formatVersion;
+            uint32_t groupCount;
+            uint32_t ruleCount;
+            uint32_t expressionCount;
+            uint32_t extractorCount;
+            uint32_t stringSize;
+            uint32_t reserved;
+            uint64_t checksum; // of everything after the header
+        };
+
+        struct GroupRecord
+        {
+            uint32_t ruleBegin;
+            uint32_t ruleEnd;
+        };
+
+        struct RuleRecord
+        {
+            uint32_t expressionBegin;
+            uint32_t expressionEnd;
+            uint32_t extractorBegin;
+            uint32_t extractorEnd;
+        };
+
+        struct ExpressionRecord
+        {
+            uint32_t patternOffset;
+            uint32_t patternSize;
+            uint32_t flags;
+        };
+
+        struct ExtractorRecord
+        {
+            uint8_t field;
+            uint8_t format;
+            char oldChar;
+            char newChar;
+            uint32_t valueOffset;
+            uint32_t valueSize;
+        };
+
+        // Read-only mapping of a whole file.
+        struct MappedFile
+        {
+        private:
+            void* data_;
+            size_t size_;
+
+        public:
+            explicit MappedFile(const std::string& path)
+            : data_(nullptr)
+            , size_(0)
+            {
+                const auto fd = ::open(path.c_str(), O_RDONLY);
+                if (fd < 0)
+                {
+                    throw std::runtime_error("Cannot open rule file: " + path);
+                }
+                struct stat info;
+                if (::fstat(fd, &info) == 0 && info.st_size > 0)
+                {
+                    size_ = static_cast<size_t>(info.st_size);
+                    data_ = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+                }
+                ::close(fd);
+                if (data_ == nullptr || data_ == MAP_FAILED)
+                {
+                    throw std::runtime_error("Cannot map rule file: " + path);
+                }
+            }
+            MappedFile(const MappedFile&) = delete;
+            MappedFile& operator=(const MappedFile&) = delete;
+            ~MappedFile()
+            {
+                ::munmap(data_, size_);
+            }
+            StringView bytes() const
+            {
+                return StringView(static_cast<const char*>(data_), size_);
+            }
+        };
+
+    public:
+        static std::shared_ptr<const RuleSet> load(const std::string& path)
+        {
+            const MappedFile file(path);
+            return std::make_shared<const RuleSet>(deserialize(file.bytes()));
+        }
+
+        static void save(const RuleTable& table, const std::string& path)
+        {
+            const auto bytes = serialize(table);
+            auto* out = std::fopen(path.c_str(), "wb");
+            if (!out)
+            {
+                throw std::runtime_error("Cannot create rule file: " + path);
+            }
+            const auto written = std::fwrite(bytes.data(), 1, bytes.size(), out);
+            if (std::fclose(out) != 0 || written != bytes.size())
+            {
+                throw std::runtime_error("Cannot write rule file: " + path);
+            }
+        }
+
+        static std::string serialize(const RuleTable& table)
+        {
+            auto groups = std::string();
+            for (const auto& group : table.groups())
+            {
+                append(groups, GroupRecord{group.ruleBegin, group.ruleEnd});
+            }
+            auto rules = std::string();
+            for (const auto& rule : table.rules())
+            {
+                append(rules, RuleRecord{rule.expressionBegin, rule.expressionEnd, rule.extractorBegin, rule.extractorEnd});
+            }
+            auto strings = std::string();
+            auto expressions = std::string();
+            for (const auto& expression : table.expressions())
+            {
+                const auto flags = (expression.flags & RegexImpl::regex::icase) ? ICASE : 0;
+                append(expressions, ExpressionRecord{size(strings), size(expression.pattern), flags});
+                strings += expression.pattern;
+            }
+            auto extractors = std::string();
+            for (const auto& extractor : table.extractors())
+            {
+                append(extractors, ExtractorRecord{static_cast<uint8_t>(extractor.field_),
+                                                   static_cast<uint8_t>(extractor.format_),
+                                                   extractor.old_,
+                                                   extractor.new_,
+                                                   size(strings),
+                                                   size(extractor.v_)});
+                strings.append(extractor.v_.data(), extractor.v_.size());
+            }
+
+            const auto body = groups + rules + expressions + extractors + strings;
+            auto header = Header();
+            std::memcpy(header.magic, "UAPR", sizeof(header.magic));
+            header.formatVersion = FORMAT_VERSION;
+            header.groupCount = size(table.groups());
+            header.ruleCount = size(table.rules());
+            header.expressionCount = size(table.expressions());
+            header.extractorCount = size(table.extractors());
+            header.stringSize = size(strings);
+            header.reserved = 0;
+            header.checksum = fnv1a(body);
+            auto bytes = std::string();
+            append(bytes, header);
+            return bytes + body;
+        }
+
+    private:
+        static std::vector<MatcherGroup> deserialize(StringView bytes)
+        {
+            auto pos = size_t{0};
+            const auto header = read<Header>(bytes, pos);
+            if (std::memcmp(header.magic, "UAPR", sizeof(header.magic)) != 0 ||
+                header.formatVersion != FORMAT_VERSION)
+            {
+                throw std::runtime_error("Not a rule file of this version");
+            }
+            if (header.checksum != fnv1a(bytes.substr(pos)))
+            {
+                throw std::runtime_error("Rule file is corrupt");
+            }
+            if (header.groupCount != GROUP_COUNT)
+            {
+                throw std::runtime_error("Rule file has the wrong number of groups");
+            }
+
+            auto groups = std::vector<GroupRecord>();
+            for (uint32_t idx = 0; idx < header.groupCount; ++idx)
+            {
+                groups.push_back(read<GroupRecord>(bytes, pos));
+            }
+            auto rules = std::vector<RuleRecord>();
+            for (uint32_t idx = 0; idx < header.ruleCount; ++idx)
+            {
+                rules.push_back(read<RuleRecord>(bytes, pos));
+            }
+            auto expressions = std::vector<Source>();
+            auto stringsBegin = pos + size_t{header.expressionCount} * sizeof(ExpressionRecord) +
+                                size_t{header.extractorCount} * sizeof(ExtractorRecord);
+            if (stringsBegin > bytes.size())
+            {
+                throw std::runtime_error("Rule file is truncated");
+            }
+            const auto strings = bytes.substr(stringsBegin, header.stringSize);
+            if (strings.size() != header.stringSize)
+            {
+                throw std::runtime_error("Rule file is truncated");
+            }
+            for (uint32_t idx = 0; idx < header.expressionCount; ++idx)
+            {
+                const auto record = read<ExpressionRecord>(bytes, pos);
+                RegexImpl::regex::flag_type flags = RegexImpl::regex::ECMAScript;
+                if (record.flags & ICASE)
+                {
+                    flags |= RegexImpl::regex::icase;
+                }
+                expressions.emplace_back(string(strings, record.patternOffset, record.patternSize).to_string(), flags);
+            }
+            auto extractors = std::vector<Extractor>();
+            for (uint32_t idx = 0; idx < header.extractorCount; ++idx)
+            {
+                const auto record = read<ExtractorRecord>(bytes, pos);
+                if (record.field >= Extractor::FIELD_COUNT ||
+                    record.format >= static_cast<uint8_t>(Extractor::Format::Count))
+                {
+                    throw std::runtime_error("Rule file has an unknown extractor");
+                }
+                extractors.push_back(Extractor(record.field,
+                                               static_cast<Extractor::Format>(record.format),
+                                               record.oldChar,
+                                               record.newChar,
+                                               intern(string(strings, record.valueOffset, record.valueSize))));
+            }
+
+            // Rules and groups have to slice their arrays in order, as
+            // RuleTable lays them out.
+            auto matcherGroups = std::vector<MatcherGroup>();
+            auto nextRule = uint32_t{0};
+            auto nextExpression = uint32_t{0};
+            auto nextExtractor = uint32_t{0};
+            for (const auto& group : groups)
+            {
+                if (group.ruleBegin != nextRule || group.ruleEnd < group.ruleBegin || group.ruleEnd > rules.size())
+                {
+                    throw std::runtime_error("Rule file has a malformed group");
+                }
+                auto matcherGroup = MatcherGroup();
+                for (auto ruleIdx = group.ruleBegin; ruleIdx < group.ruleEnd; ++ruleIdx)
+                {
+                    const auto& rule = rules[ruleIdx];
+                    if (rule.expressionBegin != nextExpression || rule.expressionEnd < rule.expressionBegin ||
+                        rule.expressionEnd > expressions.size() || rule.extractorBegin != nextExtractor ||
+                        rule.extractorEnd < rule.extractorBegin || rule.extractorEnd > extractors.size())
+                    {
+                        throw std::runtime_error("Rule file has a malformed rule");
+                    }
+                    matcherGroup.emplace_back(
+                        std::vector<Source>(expressions.begin() + rule.expressionBegin,
+                                            expressions.begin() + rule.expressionEnd),
+                        std::vector<Extractor>(extractors.begin() + rule.extractorBegin,
+                                               extractors.begin() + rule.extractorEnd));
+                    nextExpression = rule.expressionEnd;
+                    nextExtractor = rule.extractorEnd;
+                }
+                matcherGroups.push_back(std::move(matcherGroup));
+                nextRule = group.ruleEnd;
+            }
+            if (nextRule != rules.size() || nextExpression != expressions.size() || nextExtractor != extractors.size())
+            {
+                throw std::runtime_error("Rule file has records no rule uses");
+            }
+            return matcherGroups;
+        }
+
+        template <typename Record>
+        static void append(std::string& bytes, const Record& record)
+        {
+            bytes.append(reinterpret_cast<const char*>(&record), sizeof(record));
+        }
+
+        template <typename Record>
+        static Record read(StringView bytes, size_t& pos)
+        {
+            if (bytes.size() < pos + sizeof(Record))
+            {
+                throw std::runtime_error("Rule file is truncated");
+            }
+            auto record = Record();
+            std::memcpy(&record, bytes.data() + pos, sizeof(record));
+            pos += sizeof(record);
+            return record;
+        }
+
+        static StringView string(StringView strings, const uint32_t offset, const uint32_t size)
+        {
+            if (offset > strings.size() || size > strings.size() - offset)
+            {
+                throw std::runtime_error("Rule file has a string out of bounds");
+            }
+            return strings.substr(offset, size);
+        }
+
+        template <typename Container>
+        static uint32_t size(const Container& container)
+        {
+            return static_cast<uint32_t>(container.size());
+        }
+
+        static StringView intern(StringView value)
+        {
+            if (value.empty())
+            {
+                return StringView();
+            }
+            static std::mutex mutex;
+            static std::unordered_set<std::string> constants;
+            std::lock_guard<std::mutex> lock(mutex);
+            return *constants.insert(value.to_string()).first;
+        }
     };
 };
 
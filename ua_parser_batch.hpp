@@ -0,0 +1,311 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "ua_parser.hpp"
+
+namespace uap
+{
+
+// Fixed set of worker threads with a task deque each. Workers take their own
+// work newest-first and, once idle, steal the oldest task of another worker,
+// which keeps them busy when a few UAs fall through most of the rule table
+// while the rest of the batch matches early.
+struct ThreadPool
+{
+public:
+    explicit ThreadPool(const size_t threadCount = std::thread::hardware_concurrency())
+    : queues_(std::max<size_t>(threadCount, 1))
+    , threads_()
+    , sleepMutex_()
+    , wake_()
+    , pending_(0)
+    , stop_(false)
+    {
+        for (size_t idx = 0; idx < queues_.size(); ++idx)
+        {
+            threads_.emplace_back([this, idx] { run(idx); });
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto& thread : threads_)
+        {
+            thread.join();
+        }
+    }
+
+    size_t size() const
+    {
+        return threads_.size();
+    }
+
+    // Calls body(begin, end) for consecutive chunks of at most grain indices
+    // covering [0, count) and returns once all of them ran. The calling thread
+    // helps out while it waits; the first exception thrown by body is
+    // rethrown here.
+    template <typename Body>
+    void parallelFor(const size_t count, const size_t grain, Body body)
+    {
+        if (count == 0)
+        {
+            return;
+        }
+        const auto step = std::max<size_t>(grain, 1);
+        const auto chunks = (count + step - 1) / step;
+        auto job = std::make_shared<Job>(chunks);
+
+        // Hand every worker a contiguous run of chunks; stealing evens out
+        // whatever imbalance remains.
+        const auto perQueue = (chunks + queues_.size() - 1) / queues_.size();
+        for (size_t chunk = 0; chunk < chunks; ++chunk)
+        {
+            const auto begin = chunk * step;
+            const auto end = std::min(begin + step, count);
+            push(chunk / perQueue, [job, body, begin, end] {
+                try
+                {
+                    body(begin, end);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(job->mutex);
+                    if (!job->error)
+                    {
+                        job->error = std::current_exception();
+                    }
+                }
+                job->finish();
+            });
+        }
+
+        Task task;
+        while (job->remaining.load() != 0 && steal(queues_.size(), task))
+        {
+            task();
+        }
+        std::unique_lock<std::mutex> lock(job->mutex);
+        job->done.wait(lock, [&job] { return job->remaining.load() == 0; });
+        if (job->error)
+        {
+            std::rethrow_exception(job->error);
+        }
+    }
+
+private:
+    using Task = std::function<void()>;
+
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    struct Job
+    {
+        explicit Job(const size_t chunks)
+        : remaining(chunks)
+        {
+        }
+
+        void finish()
+        {
+            if (remaining.fetch_sub(1) == 1)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                done.notify_all();
+            }
+        }
+
+        std::atomic<size_t> remaining;
+        std::mutex mutex;
+        std::condition_variable done;
+        std::exception_ptr error;
+    };
+
+private:
+    void push(const size_t queueIdx, Task task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex_);
+            ++pending_;
+        }
+        {
+            auto& queue = queues_[queueIdx];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(std::move(task));
+        }
+        wake_.notify_one();
+    }
+
+    bool pop(const size_t queueIdx, Task& task)
+    {
+        auto& queue = queues_[queueIdx];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty())
+        {
+            return false;
+        }
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+        --pending_;
+        return true;
+    }
+
+    // Takes the oldest task of any queue other than self, starting with the
+    // one after it.
+    bool steal(const size_t self, Task& task)
+    {
+        for (size_t offset = 1; offset <= queues_.size(); ++offset)
+        {
+            const auto victimIdx = (self + offset) % queues_.size();
+            if (victimIdx == self)
+            {
+                continue;
+            }
+            auto& victim = queues_[victimIdx];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty())
+            {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                --pending_;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run(const size_t self)
+    {
+        Task task;
+        while (true)
+        {
+            if (pop(self, task) || steal(self, task))
+            {
+                task();
+                task = nullptr;
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex_);
+            wake_.wait(lock, [this] { return stop_ || pending_.load() != 0; });
+            if (stop_)
+            {
+                return;
+            }
+        }
+    }
+
+private:
+    std::vector<Queue> queues_;
+    std::vector<std::thread> threads_;
+    std::mutex sleepMutex_;
+    std::condition_variable wake_;
+    std::atomic<size_t> pending_;
+    bool stop_;
+};
+
+// Parses uas[0, count) into results[0, count) on the calling thread.
+inline void parseBatch(const UaParser& parser,
+                       const StringView* uas,
+                       const size_t count,
+                       UaParser::Result* results)
+{
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        results[idx] = parser.parseView(uas[idx]).toResult();
+    }
+}
+
+// Same as above, spread over the workers of pool in chunks of grain UAs.
+inline void parseBatch(const UaParser& parser,
+                       ThreadPool& pool,
+                       const StringView* uas,
+                       const size_t count,
+                       UaParser::Result* results,
+                       const size_t grain = 64)
+{
+    pool.parallelFor(count, grain, [&parser, uas, results](const size_t begin, const size_t end) {
+        parseBatch(parser, uas + begin, end - begin, results + begin);
+    });
+}
+
+// One Result per distinct UA of a batch, in order of first appearance, and
+// for every UA of the batch the position of its result.
+struct DistinctResults
+{
+    std::vector<UaParser::Result> results;
+    std::vector<uint32_t> index;
+};
+
+// Parses every distinct UA of uas[0, count) once, spread over the workers
+// of pool. Memory is bounded by the batch: nothing outlives the call.
+inline DistinctResults parseDistinct(const UaParser& parser,
+                                     ThreadPool& pool,
+                                     const StringView* uas,
+                                     const size_t count,
+                                     const size_t grain = 64)
+{
+    struct Hash
+    {
+        size_t operator()(StringView ua) const
+        {
+            return static_cast<size_t>(fnv1a(ua));
+        }
+    };
+
+    auto distinct = DistinctResults();
+    distinct.index.resize(count);
+    auto positions = std::unordered_map<StringView, uint32_t, Hash>();
+    positions.reserve(count);
+    auto firsts = std::vector<StringView>();
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        const auto inserted = positions.emplace(uas[idx], static_cast<uint32_t>(firsts.size()));
+        if (inserted.second)
+        {
+            firsts.push_back(uas[idx]);
+        }
+        distinct.index[idx] = inserted.first->second;
+    }
+    distinct.results.resize(firsts.size());
+    parseBatch(parser, pool, firsts.data(), firsts.size(), distinct.results.data(), grain);
+    return distinct;
+}
+
+// Same results as parseBatch(), parsing every distinct UA once and copying
+// its result to the duplicates.
+inline void parseBatchDistinct(const UaParser& parser,
+                               ThreadPool& pool,
+                               const StringView* uas,
+                               const size_t count,
+                               UaParser::Result* results,
+                               const size_t grain = 64)
+{
+    const auto distinct = parseDistinct(parser, pool, uas, count, grain);
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        results[idx] = distinct.results[distinct.index[idx]];
+    }
+}
+
+} // namespace uap
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "ua_parser.hpp"
+
+namespace uap
+{
+
+// Memoizes UaParser::parse() for the few thousand UAs that make up most of
+// real traffic. Entries are spread over independently locked LRU shards, so
+// concurrent callers only contend when they hash to the same shard.
+// Entries remember the rules they were parsed with and are dropped on
+// lookup once the parser has loaded others.
+struct CachingUaParser
+{
+public:
+    struct Stats
+    {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        size_t size;
+    };
+
+public:
+    explicit CachingUaParser(const size_t capacity,
+                             const size_t shardCount = 16,
+                             UaParser parser = UaParser{})
+    : parser_(std::move(parser))
+    , shardCount_(std::max<size_t>(std::min(shardCount, capacity), 1))
+    , shards_(new Shard[shardCount_])
+    {
+        // Split exactly, the first shards taking the remainder, so that the
+        // shards never hold more than capacity entries together.
+        for (size_t idx = 0; idx < shardCount_; ++idx)
+        {
+            shards_[idx].capacity = capacity / shardCount_ + (idx < capacity % shardCount_ ? 1 : 0);
+        }
+    }
+
+    UaParser::Result parse(StringView ua) const
+    {
+        const auto hash = fnv1a(ua);
+        const auto rulesVersion = parser_.rulesVersion();
+        auto& shard = shards_[(hash >> 32) % shardCount_];
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            const auto it = shard.index.find(Key{hash, ua});
+            if (it != shard.index.end() && it->second->rulesVersion == rulesVersion)
+            {
+                ++shard.hits;
+                shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+                return it->second->result;
+            }
+            if (it != shard.index.end())
+            {
+                const auto entry = it->second;
+                shard.index.erase(it);
+                shard.lru.erase(entry);
+            }
+            ++shard.misses;
+        }
+
+        // A budget that ran out says more about the moment than about the
+        // UA: a stall may have cut the parse short, so try again next time.
+        auto result = parser_.parseView(ua).toResult();
+        if (shard.capacity == 0 || result.budgetExceeded)
+        {
+            return result;
+        }
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (shard.index.find(Key{hash, ua}) != shard.index.end())
+        {
+            return result;
+        }
+        shard.lru.push_front(Entry{ua.to_string(), rulesVersion, result});
+        shard.index.emplace(Key{hash, shard.lru.front().ua}, shard.lru.begin());
+        if (shard.lru.size() > shard.capacity)
+        {
+            const auto& victim = shard.lru.back();
+            shard.index.erase(Key{fnv1a(victim.ua), victim.ua});
+            shard.lru.pop_back();
+            ++shard.evictions;
+        }
+        return result;
+    }
+
+    // Parses every UA in [first, last) so that later lookups hit.
+    template <typename Iterator>
+    void warmup(Iterator first, Iterator last) const
+    {
+        for (; first != last; ++first)
+        {
+            parse(*first);
+        }
+    }
+
+    Stats stats() const
+    {
+        auto stats = Stats{0, 0, 0, 0};
+        for (size_t idx = 0; idx < shardCount_; ++idx)
+        {
+            auto& shard = shards_[idx];
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            stats.hits += shard.hits;
+            stats.misses += shard.misses;
+            stats.evictions += shard.evictions;
+            stats.size += shard.lru.size();
+        }
+        return stats;
+    }
+
+    void clear() const
+    {
+        for (size_t idx = 0; idx < shardCount_; ++idx)
+        {
+            auto& shard = shards_[idx];
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.index.clear();
+            shard.lru.clear();
+        }
+    }
+
+private:
+    struct Entry
+    {
+        std::string ua;
+        uint64_t rulesVersion;
+        UaParser::Result result;
+    };
+
+    struct Key
+    {
+        uint64_t hash;
+        StringView ua;
+
+        bool operator==(const Key& other) const
+        {
+            return hash == other.hash && ua == other.ua;
+        }
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key& key) const
+        {
+            return static_cast<size_t>(key.hash);
+        }
+    };
+
+    struct Shard
+    {
+        std::mutex mutex;
+        std::list<Entry> lru;
+        std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+        size_t capacity = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        char padding[64]; // keeps neighbouring shards' locks on separate cache lines
+    };
+
+private:
+    UaParser parser_;
+    size_t shardCount_;
+    std::unique_ptr<Shard[]> shards_;
+};
+
+} // namespace uap
@@ -0,0 +1,519 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/functional/hash.hpp>
+
+#include "ua_parser.hpp"
+
+namespace uap
+{
+
+// Parse results kept on disk between runs of batch jobs that see the same
+// UAs over and over. The file is memory-mapped and looked up in place: an
+// open-addressing table of UA hashes, then one record per UA, then the
+// strings they point into, all in host byte order.
+//
+// A file only holds results of one UaParser::rulesVersion(). Opened with
+// another version it reads as empty and save() replaces it, so results of
+// other rules are never served. Other parser settings are not recorded:
+// open a file only with parsers configured like the one that filled it.
+//
+// Lookups are thread-safe; add() and save() are not, and must not run
+// concurrently with anything else on the same CacheFile.
+struct CacheFile
+{
+public:
+    // Opens path if it exists. Throws std::runtime_error if it cannot be
+    // read or is not a cache file in one piece.
+    CacheFile(const std::string& path, const uint64_t rulesVersion)
+    : rulesVersion_(rulesVersion)
+    , data_(nullptr)
+    , size_(0)
+    , slots_(nullptr)
+    , slotCount_(0)
+    , entries_(nullptr)
+    , entryCount_(0)
+    , strings_()
+    , added_()
+    , addedIndex_()
+    , values_()
+    {
+        // The destructor will not run for a constructor that throws.
+        try
+        {
+            map(path);
+        }
+        catch (...)
+        {
+            unmap();
+            throw;
+        }
+    }
+
+    CacheFile(const CacheFile&) = delete;
+    CacheFile& operator=(const CacheFile&) = delete;
+
+    ~CacheFile()
+    {
+        unmap();
+    }
+
+    // Fills result with views into the file or into this CacheFile, valid
+    // as long as it is, if ua was parsed before.
+    bool lookup(StringView ua, UaParser::ResultView& result) const
+    {
+        const auto hash = fnv1a(ua);
+        if (slotCount_ != 0)
+        {
+            for (auto idx = hash & (slotCount_ - 1);; idx = (idx + 1) & (slotCount_ - 1))
+            {
+                const auto& slot = slots_[idx];
+                if (slot.entry == 0)
+                {
+                    break;
+                }
+                const auto& entry = entries_[slot.entry - 1];
+                if (slot.hash == hash && string(entry.ua) == ua)
+                {
+                    if (entry.flags & BUDGET_EXCEEDED)
+                    {
+                        break;
+                    }
+                    fill(entry, result);
+                    return true;
+                }
+            }
+        }
+        const auto it = addedIndex_.find(Key{hash, ua});
+        if (it == addedIndex_.end())
+        {
+            return false;
+        }
+        const auto& added = added_[it->second];
+        for (size_t field = 0; field < FIELD_COUNT; ++field)
+        {
+            result.*fields()[field] = added.values[field];
+        }
+        setFlags(added.flags, result);
+        return true;
+    }
+
+    // Remembers the result of parsing ua, for lookups and the next save().
+    // UAs already in the cache are left alone, and so are results cut short
+    // by the time budget: served on every later run, one stall would stick.
+    void add(StringView ua, const UaParser::ResultView& result)
+    {
+        StringView values[FIELD_COUNT];
+        for (size_t field = 0; field < FIELD_COUNT; ++field)
+        {
+            values[field] = result.*fields()[field];
+        }
+        add(ua, values, flags(result.truncated, result.budgetExceeded, result.isBot));
+    }
+
+    void add(StringView ua, const UaParser::Result& result)
+    {
+        StringView values[FIELD_COUNT];
+        for (size_t field = 0; field < FIELD_COUNT; ++field)
+        {
+            values[field] = result.*resultFields()[field];
+        }
+        add(ua, values, flags(result.truncated, result.budgetExceeded, result.isBot));
+    }
+
+    // Entries in the file plus those added since it was opened.
+    size_t size() const
+    {
+        return entryCount_ + added_.size();
+    }
+
+    // Writes every entry to path, through a temporary file renamed into
+    // place, so a job killed halfway leaves the old file intact. Throws
+    // std::runtime_error if it cannot be written.
+    void save(const std::string& path) const
+    {
+        // Values are shared between entries; offsets is keyed by views into
+        // the mapping and values_, since the pool moves as it grows.
+        auto pool = std::string();
+        auto offsets = std::unordered_map<StringView, uint32_t, boost::hash<StringView>>();
+        const auto intern = [&pool, &offsets](StringView value, const bool shared) {
+            if (shared)
+            {
+                const auto it = offsets.find(value);
+                if (it != offsets.end())
+                {
+                    return StringRef{it->second, static_cast<uint32_t>(value.size())};
+                }
+            }
+            if (pool.size() + value.size() > UINT32_MAX)
+            {
+                throw std::runtime_error("Cache file is too large");
+            }
+            const auto ref = StringRef{static_cast<uint32_t>(pool.size()), static_cast<uint32_t>(value.size())};
+            pool.append(value.data(), value.size());
+            if (shared)
+            {
+                offsets.emplace(value, ref.offset);
+            }
+            return ref;
+        };
+
+        auto entries = std::vector<EntryRecord>();
+        auto hashes = std::vector<uint64_t>();
+        const auto append = [&](StringView ua, const StringView* values, const uint32_t flags) {
+            auto entry = EntryRecord();
+            entry.ua = intern(ua, false);
+            for (size_t field = 0; field < FIELD_COUNT; ++field)
+            {
+                entry.values[field] = intern(values[field], true);
+            }
+            entry.flags = flags;
+            entries.push_back(entry);
+            hashes.push_back(fnv1a(ua));
+        };
+        for (uint32_t idx = 0; idx < entryCount_; ++idx)
+        {
+            const auto& entry = entries_[idx];
+            if (entry.flags & BUDGET_EXCEEDED)
+            {
+                continue;
+            }
+            StringView values[FIELD_COUNT];
+            for (size_t field = 0; field < FIELD_COUNT; ++field)
+            {
+                values[field] = string(entry.values[field]);
+            }
+            append(string(entry.ua), values, entry.flags);
+        }
+        for (const auto& added : added_)
+        {
+            append(added.ua, added.values, added.flags);
+        }
+
+        // Load factor at most one half.
+        auto slotCount = uint32_t{entries.empty() ? 0u : 2u};
+        while (slotCount < 2 * entries.size())
+        {
+            slotCount *= 2;
+        }
+        auto slots = std::vector<Slot>(slotCount, Slot{0, 0, 0});
+        for (size_t idx = 0; idx < entries.size(); ++idx)
+        {
+            auto slot = hashes[idx] & (slotCount - 1);
+            while (slots[slot].entry != 0)
+            {
+                slot = (slot + 1) & (slotCount - 1);
+            }
+            slots[slot] = Slot{hashes[idx], static_cast<uint32_t>(idx + 1), 0};
+        }
+
+        auto header = Header();
+        std::memcpy(header.magic, "UAPK", sizeof(header.magic));
+        header.formatVersion = FORMAT_VERSION;
+        header.rulesVersion = rulesVersion_;
+        header.slotCount = slotCount;
+        header.entryCount = static_cast<uint32_t>(entries.size());
+        header.stringSize = pool.size();
+
+        const auto temporary = path + ".tmp";
+        auto* out = std::fopen(temporary.c_str(), "wb");
+        if (!out)
+        {
+            throw std::runtime_error("Cannot create cache file: " + temporary);
+        }
+        auto written = std::fwrite(&header, sizeof(header), 1, out) == 1;
+        written = written && std::fwrite(slots.data(), sizeof(Slot), slots.size(), out) == slots.size();
+        written = written && std::fwrite(entries.data(), sizeof(EntryRecord), entries.size(), out) == entries.size();
+        written = written && std::fwrite(pool.data(), 1, pool.size(), out) == pool.size();
+        if (std::fclose(out) != 0 || !written || std::rename(temporary.c_str(), path.c_str()) != 0)
+        {
+            std::remove(temporary.c_str());
+            throw std::runtime_error("Cannot write cache file: " + path);
+        }
+    }
+
+private:
+    static const uint32_t FORMAT_VERSION = 1;
+
+    // The ResultView fields, bot name included.
+    enum : size_t
+    {
+        FIELD_COUNT = 12,
+    };
+
+    enum : uint32_t
+    {
+        TRUNCATED = 1u << 0,
+        BUDGET_EXCEEDED = 1u << 1,
+        IS_BOT = 1u << 2,
+    };
+
+    struct Header
+    {
+        char magic[4];
+        uint32_t formatVersion;
+        uint64_t rulesVersion;
+        uint32_t slotCount; // a power of two, or zero
+        uint32_t entryCount;
+        uint64_t stringSize;
+    };
+
+    struct Slot
+    {
+        uint64_t hash;
+        uint32_t entry; // index + 1, zero for an empty slot
+        uint32_t reserved;
+    };
+
+    struct StringRef
+    {
+        uint32_t offset;
+        uint32_t size;
+    };
+
+    struct EntryRecord
+    {
+        StringRef ua;
+        StringRef values[FIELD_COUNT];
+        uint32_t flags;
+    };
+
+    struct Added
+    {
+        std::string ua;
+        StringView values[FIELD_COUNT]; // into values_
+        uint32_t flags;
+    };
+
+    struct Key
+    {
+        uint64_t hash;
+        StringView ua;
+
+        bool operator==(const Key& other) const
+        {
+            return hash == other.hash && ua == other.ua;
+        }
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key& key) const
+        {
+            return static_cast<size_t>(key.hash);
+        }
+    };
+
+private:
+    static StringView UaParser::ResultView::*const* fields()
+    {
+        static StringView UaParser::ResultView::*const fields[FIELD_COUNT] = {
+            &UaParser::ResultView::browserName,
+            &UaParser::ResultView::browserUnit,
+            &UaParser::ResultView::browserVersion,
+            &UaParser::ResultView::cpuArchitecture,
+            &UaParser::ResultView::deviceType,
+            &UaParser::ResultView::deviceModel,
+            &UaParser::ResultView::deviceVendor,
+            &UaParser::ResultView::engineName,
+            &UaParser::ResultView::engineVersion,
+            &UaParser::ResultView::osName,
+            &UaParser::ResultView::osVersion,
+            &UaParser::ResultView::botName,
+        };
+        return fields;
+    }
+
+    // The same fields in Result.
+    static std::string UaParser::Result::*const* resultFields()
+    {
+        static std::string UaParser::Result::*const fields[FIELD_COUNT] = {
+            &UaParser::Result::browserName,
+            &UaParser::Result::browserUnit,
+            &UaParser::Result::browserVersion,
+            &UaParser::Result::cpuArchitecture,
+            &UaParser::Result::deviceType,
+            &UaParser::Result::deviceModel,
+            &UaParser::Result::deviceVendor,
+            &UaParser::Result::engineName,
+            &UaParser::Result::engineVersion,
+            &UaParser::Result::osName,
+            &UaParser::Result::osVersion,
+            &UaParser::Result::botName,
+        };
+        return fields;
+    }
+
+    static uint32_t flags(const bool truncated, const bool budgetExceeded, const bool isBot)
+    {
+        auto flags = uint32_t{0};
+        flags |= truncated ? uint32_t{TRUNCATED} : 0;
+        flags |= budgetExceeded ? uint32_t{BUDGET_EXCEEDED} : 0;
+        flags |= isBot ? uint32_t{IS_BOT} : 0;
+        return flags;
+    }
+
+    static void setFlags(const uint32_t flags, UaParser::ResultView& result)
+    {
+        result.truncated = (flags & TRUNCATED) != 0;
+        result.budgetExceeded = (flags & BUDGET_EXCEEDED) != 0;
+        result.isBot = (flags & IS_BOT) != 0;
+        result.browserVersionNumber = Version::parse(result.browserVersion);
+        result.engineVersionNumber = Version::parse(result.engineVersion);
+        result.osVersionNumber = Version::parse(result.osVersion);
+    }
+
+    StringView string(const StringRef& ref) const
+    {
+        return strings_.substr(ref.offset, ref.size);
+    }
+
+    void fill(const EntryRecord& entry, UaParser::ResultView& result) const
+    {
+        for (size_t field = 0; field < FIELD_COUNT; ++field)
+        {
+            result.*fields()[field] = string(entry.values[field]);
+        }
+        setFlags(entry.flags, result);
+    }
+
+    void add(StringView ua, const StringView* values, const uint32_t flags)
+    {
+        auto probe = UaParser::ResultView();
+        if ((flags & BUDGET_EXCEEDED) || lookup(ua, probe))
+        {
+            return;
+        }
+        added_.emplace_back();
+        auto& added = added_.back();
+        added.ua = ua.to_string();
+        for (size_t field = 0; field < FIELD_COUNT; ++field)
+        {
+            added.values[field] = *values_.insert(values[field].to_string()).first;
+        }
+        added.flags = flags;
+        addedIndex_.emplace(Key{fnv1a(added.ua), added.ua}, added_.size() - 1);
+    }
+
+    // Checks every slot and record once, so lookups need not.
+    void map(const std::string& path)
+    {
+        const auto fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            if (errno == ENOENT)
+            {
+                return;
+            }
+            throw std::runtime_error("Cannot open cache file: " + path);
+        }
+        struct stat info;
+        if (::fstat(fd, &info) == 0 && info.st_size > 0)
+        {
+            size_ = static_cast<size_t>(info.st_size);
+            data_ = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        ::close(fd);
+        if (data_ == MAP_FAILED || (size_ != 0 && !data_))
+        {
+            data_ = nullptr;
+            throw std::runtime_error("Cannot map cache file: " + path);
+        }
+
+        auto header = Header();
+        if (size_ < sizeof(header))
+        {
+            throw std::runtime_error("Not a cache file: " + path);
+        }
+        std::memcpy(&header, data_, sizeof(header));
+        if (std::memcmp(header.magic, "UAPK", sizeof(header.magic)) != 0 || header.formatVersion != FORMAT_VERSION)
+        {
+            throw std::runtime_error("Not a cache file of this version: " + path);
+        }
+        if (header.rulesVersion != rulesVersion_)
+        {
+            return;
+        }
+        const auto slotsSize = uint64_t{header.slotCount} * sizeof(Slot);
+        const auto entriesSize = uint64_t{header.entryCount} * sizeof(EntryRecord);
+        if ((header.slotCount & (header.slotCount - 1)) != 0 || header.entryCount > header.slotCount ||
+            sizeof(header) + slotsSize + entriesSize + header.stringSize != size_)
+        {
+            throw std::runtime_error("Cache file is corrupt: " + path);
+        }
+
+        const auto* bytes = static_cast<const char*>(data_);
+        const auto* slots = reinterpret_cast<const Slot*>(bytes + sizeof(header));
+        const auto* entries = reinterpret_cast<const EntryRecord*>(bytes + sizeof(header) + slotsSize);
+        const auto strings = StringView(bytes + sizeof(header) + slotsSize + entriesSize, header.stringSize);
+        const auto inBounds = [&strings](const StringRef& ref) {
+            return ref.offset <= strings.size() && ref.size <= strings.size() - ref.offset;
+        };
+        // A free slot has to be left for lookups of missing UAs to stop at.
+        auto occupied = uint32_t{0};
+        for (uint32_t idx = 0; idx < header.slotCount; ++idx)
+        {
+            occupied += slots[idx].entry != 0;
+            if (slots[idx].entry > header.entryCount || occupied == header.slotCount)
+            {
+                throw std::runtime_error("Cache file is corrupt: " + path);
+            }
+        }
+        for (uint32_t idx = 0; idx < header.entryCount; ++idx)
+        {
+            auto valid = inBounds(entries[idx].ua);
+            for (const auto& value : entries[idx].values)
+            {
+                valid = valid && inBounds(value);
+            }
+            if (!valid)
+            {
+                throw std::runtime_error("Cache file is corrupt: " + path);
+            }
+        }
+        slots_ = slots;
+        slotCount_ = header.slotCount;
+        entries_ = entries;
+        entryCount_ = header.entryCount;
+        strings_ = strings;
+    }
+
+    void unmap()
+    {
+        if (data_)
+        {
+            ::munmap(data_, size_);
+            data_ = nullptr;
+        }
+    }
+
+private:
+    uint64_t rulesVersion_;
+    void* data_;
+    size_t size_;
+    const Slot* slots_;
+    uint32_t slotCount_;
+    const EntryRecord* entries_;
+    uint32_t entryCount_;
+    StringView strings_;
+    std::deque<Added> added_; // never moves its elements
+    std::unordered_map<Key, size_t, KeyHash> addedIndex_;
+    std::unordered_set<std::string> values_;
+};
+
+} // namespace uap
@@ -0,0 +1,277 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+#include "ua_parser.hpp"
+
+namespace uap
+{
+
+// Hands out a dense 32-bit id for every distinct string it is given, 0
+// being the empty string. Ids never change and lookups by id take no lock,
+// so they can be resolved long after they were handed out. Interning locks
+// one of a few shards, picked by hash.
+struct InternTable
+{
+public:
+    enum : uint32_t
+    {
+        EMPTY = 0,
+    };
+
+public:
+    InternTable()
+    : next_(1)
+    , chunks_()
+    {
+        for (auto& chunk : chunks_)
+        {
+            chunk.store(nullptr);
+        }
+        slot(EMPTY).store(&empty());
+    }
+
+    InternTable(const InternTable&) = delete;
+    InternTable& operator=(const InternTable&) = delete;
+
+    ~InternTable()
+    {
+        for (auto& chunk : chunks_)
+        {
+            delete[] chunk.load();
+        }
+    }
+
+    // Throws std::length_error once MAX_IDS strings are interned.
+    uint32_t intern(StringView value)
+    {
+        if (value.empty())
+        {
+            return EMPTY;
+        }
+        const auto hash = fnv1a(value);
+        auto& shard = shards_[hash % SHARD_COUNT];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        const auto it = shard.ids.find(Key{hash, value});
+        if (it != shard.ids.end())
+        {
+            return it->second;
+        }
+        const auto id = next_.fetch_add(1);
+        if (id >= MAX_IDS)
+        {
+            throw std::length_error("InternTable is full");
+        }
+        shard.strings.push_back(value.to_string());
+        const auto& stored = shard.strings.back();
+        slot(id).store(&stored, std::memory_order_release);
+        shard.ids.emplace(Key{hash, stored}, id);
+        return id;
+    }
+
+    // id has to come from intern() on this table.
+    StringView lookup(const uint32_t id) const
+    {
+        const auto* chunk = chunks_[id / CHUNK_SIZE].load(std::memory_order_acquire);
+        return *chunk[id % CHUNK_SIZE].load(std::memory_order_acquire);
+    }
+
+    // Ids handed out so far, the empty string included.
+    size_t size() const
+    {
+        return std::min<size_t>(next_.load(), size_t{MAX_IDS});
+    }
+
+private:
+    static const uint32_t CHUNK_SIZE = 4096;
+    static const uint32_t MAX_CHUNKS = 1024;
+    static const uint32_t MAX_IDS = CHUNK_SIZE * MAX_CHUNKS;
+    static const size_t SHARD_COUNT = 16;
+
+    using Slot = std::atomic<const std::string*>;
+
+    struct Key
+    {
+        uint64_t hash;
+        StringView value;
+
+        bool operator==(const Key& other) const
+        {
+            return hash == other.hash && value == other.value;
+        }
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key& key) const
+        {
+            return static_cast<size_t>(key.hash >> 8);
+        }
+    };
+
+    struct Shard
+    {
+        std::mutex mutex;
+        std::deque<std::string> strings; // never moves its elements
+        std::unordered_map<Key, uint32_t, KeyHash> ids;
+        char padding[64];
+    };
+
+private:
+    static const std::string& empty()
+    {
+        static const auto value = std::string();
+        return value;
+    }
+
+    // Chunks are only ever added, under the lock of the shard that needs
+    // the first slot in them; racing shards settle on one.
+    Slot& slot(const uint32_t id)
+    {
+        auto& chunk = chunks_[id / CHUNK_SIZE];
+        auto* slots = chunk.load(std::memory_order_acquire);
+        if (!slots)
+        {
+            auto* fresh = new Slot[CHUNK_SIZE];
+            for (uint32_t idx = 0; idx < CHUNK_SIZE; ++idx)
+            {
+                fresh[idx].store(nullptr, std::memory_order_relaxed);
+            }
+            if (chunk.compare_exchange_strong(slots, fresh, std::memory_order_acq_rel))
+            {
+                slots = fresh;
+            }
+            else
+            {
+                delete[] fresh;
+            }
+        }
+        return slots[id % CHUNK_SIZE];
+    }
+
+private:
+    std::atomic<uint32_t> next_;
+    std::atomic<Slot*> chunks_[MAX_CHUNKS];
+    Shard shards_[SHARD_COUNT];
+};
+
+// Major, minor and patch of a version, 21 bits each, so packed versions
+// order like the versions themselves; larger components saturate.
+inline uint64_t packVersion(const Version& version)
+{
+    static const uint64_t COMPONENT_MAX = (uint64_t{1} << 21) - 1;
+    const auto major = std::min<uint64_t>(version.major, COMPONENT_MAX);
+    const auto minor = std::min<uint64_t>(version.minor, COMPONENT_MAX);
+    const auto patch = std::min<uint64_t>(version.patch, COMPONENT_MAX);
+    return major << 42 | minor << 21 | patch;
+}
+
+// Result as a fixed-size value: every field is an id in the InternTable
+// it was compacted with, and the versions are also packed numerically.
+// Cheap to copy, compare and hash, which is what rollups grouping by these
+// fields spend their time on.
+struct CompactResult
+{
+    uint32_t browserName;
+    uint32_t browserUnit;
+    uint32_t browserVersion;
+    uint32_t cpuArchitecture;
+    uint32_t deviceType;
+    uint32_t deviceModel;
+    uint32_t deviceVendor;
+    uint32_t engineName;
+    uint32_t engineVersion;
+    uint32_t osName;
+    uint32_t osVersion;
+    uint32_t botName;
+    uint8_t truncated;
+    uint8_t budgetExceeded;
+    uint8_t isBot;
+    uint64_t browserVersionPacked;
+    uint64_t engineVersionPacked;
+    uint64_t osVersionPacked;
+
+    bool operator==(const CompactResult& other) const
+    {
+        return browserName == other.browserName && browserUnit == other.browserUnit &&
+               browserVersion == other.browserVersion && cpuArchitecture == other.cpuArchitecture &&
+               deviceType == other.deviceType && deviceModel == other.deviceModel &&
+               deviceVendor == other.deviceVendor && engineName == other.engineName &&
+               engineVersion == other.engineVersion && osName == other.osName && osVersion == other.osVersion &&
+               botName == other.botName && truncated == other.truncated &&
+               budgetExceeded == other.budgetExceeded && isBot == other.isBot;
+    }
+
+    bool operator!=(const CompactResult& other) const
+    {
+        return !(*this == other);
+    }
+};
+
+// The packed versions follow from the version ids, so they are left out.
+struct CompactResultHash
+{
+    size_t operator()(const CompactResult& result) const
+    {
+        const uint32_t ids[] = {
+            result.browserName,
+            result.browserUnit,
+            result.browserVersion,
+            result.cpuArchitecture,
+            result.deviceType,
+            result.deviceModel,
+            result.deviceVendor,
+            result.engineName,
+            result.engineVersion,
+            result.osName,
+            result.osVersion,
+            result.botName,
+            static_cast<uint32_t>(result.isBot) << 2 | static_cast<uint32_t>(result.truncated) << 1 |
+                result.budgetExceeded,
+        };
+        return static_cast<size_t>(fnv1a(StringView(reinterpret_cast<const char*>(ids), sizeof(ids))));
+    }
+};
+
+inline CompactResult compact(const UaParser::ResultView& view, InternTable& table)
+{
+    auto result = CompactResult();
+    result.browserName = table.intern(view.browserName);
+    result.browserUnit = table.intern(view.browserUnit);
+    result.browserVersion = table.intern(view.browserVersion);
+    result.cpuArchitecture = table.intern(view.cpuArchitecture);
+    result.deviceType = table.intern(view.deviceType);
+    result.deviceModel = table.intern(view.deviceModel);
+    result.deviceVendor = table.intern(view.deviceVendor);
+    result.engineName = table.intern(view.engineName);
+    result.engineVersion = table.intern(view.engineVersion);
+    result.osName = table.intern(view.osName);
+    result.osVersion = table.intern(view.osVersion);
+    result.botName = table.intern(view.botName);
+    result.truncated = view.truncated;
+    result.budgetExceeded = view.budgetExceeded;
+    result.isBot = view.isBot;
+    result.browserVersionPacked = packVersion(view.browserVersionNumber);
+    result.engineVersionPacked = packVersion(view.engineVersionNumber);
+    result.osVersionPacked = packVersion(view.osVersionNumber);
+    return result;
+}
+
+// Parses ua straight into a CompactResult, without building strings.
+inline CompactResult parseCompact(const UaParser& parser,
+                                  InternTable& table,
+                                  StringView ua,
+                                  const FieldMask fields = Fields::All)
+{
+    return compact(parser.parseView(ua, fields), table);
+}
+
+} // namespace uap